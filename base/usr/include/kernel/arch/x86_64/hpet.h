@@ -17,4 +17,6 @@ extern uint32_t hpet_period;
 void hpet_install(void);
 void hpet_sleep(size_t us);
 size_t hpet_get_ticks(void);
+size_t hpet_us_to_ticks(size_t us);
+size_t hpet_ticks_to_us(size_t ticks);
 void hpet_read_time(long *sec, long *nsec);
\ No newline at end of file
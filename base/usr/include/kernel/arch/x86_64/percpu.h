@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Per-cpu variables are placed in the .percpu section, which the boot
+ * cpu uses as is and every other core gets a copy of. A core's GS base
+ * is its copy minus the start of the section, so the address of a
+ * variable doubles as its offset and this_cpu_read() is a single load.
+ *
+ * Kernel code always runs with that GS base. The user's GS base waits
+ * in IA32_GS_KERNEL_MSR and is swapped in by swapgs on the way back to
+ * ring 3.
+ */
+#define DEFINE_PER_CPU(type, name) \
+    __attribute__((section(".percpu"))) __typeof__(type) name
+
+#define DECLARE_PER_CPU(type, name) \
+    extern __attribute__((section(".percpu"))) __typeof__(type) name
+
+#define this_cpu_read(var) ({                                   \
+    __typeof__(var) __val;                                      \
+    asm volatile ("mov %%gs:%1, %0" : "=r"(__val) : "m"(var));  \
+    __val;                                                      \
+})
+
+#define this_cpu_write(var, val) do {                           \
+    __typeof__(var) __val = (val);                              \
+    asm volatile ("mov %1, %%gs:%0" : "=m"(var) : "r"(__val));  \
+} while (0)
+
+/* another core's copy, by core id */
+#define per_cpu(var, cpu) \
+    (*(__typeof__(&(var)))((uintptr_t)&(var) + percpu_offset[(cpu)]))
+
+extern uintptr_t percpu_offset[];
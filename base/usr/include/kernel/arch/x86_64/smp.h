@@ -1,23 +1,58 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdatomic.h>
+#include <kernel/arch/x86_64/percpu.h>
 
 #define SMP_MAX_CORES 32
+#define SMP_PAGE_CACHE_SIZE  64
+#define SMP_PAGE_CACHE_BATCH 16
+
+struct task_heap {
+    struct task **tasks;
+    uint32_t count;
+    uint32_t size;
+};
 
 struct cpu {
     uint64_t id;
     uint64_t lapic_id;
-    uintptr_t *pml4;
+    uintptr_t *pml4;        /* page map the mmu functions work on */
+    uintptr_t *loaded_pml4; /* page map in cr3 */
+    bool pcid;              /* tlb entries are tagged per page map */
+    uint16_t pcid_next;
+    uint32_t pcid_gen;
 
     struct task *processes;
     struct task *current_proc;
     struct task *cleaner_proc;
     struct task *idle_proc;
     struct task *terminated_processes;
+    struct task *rt_head;   /* runnable real-time tasks, by priority */
+    struct task *rt_tail;
+    struct task_heap fair;  /* other runnable tasks, by time.vruntime */
+    struct task_heap sleepers; /* by time.end */
+    uint64_t min_vruntime;
+    uint32_t nr_running;
+    struct task *last_proc; /* task switched away from, may still be on its stack */
+    uint32_t load_avg;      /* queued tasks, in 1/SCHED_LOAD_SCALE */
+    uint32_t balance_ticks;
+    uint64_t nr_switches;
+    uint64_t nr_migrations;
+    uint32_t preempt_count; /* nested sched_lock() calls of the running task */
+    bool need_resched;      /* a tick arrived while preemption was off */
     atomic_flag sched_lock;
     atomic_flag vmm_lock;
+
+    uint32_t page_cache[SMP_PAGE_CACHE_SIZE];
+    uint32_t page_cache_count;
 };
 
 void smp_initialize(void);
 struct cpu *get_core(int core);
-struct cpu *this_core(void);
\ No newline at end of file
+
+DECLARE_PER_CPU(struct cpu *, current_cpu);
+
+static inline struct cpu *this_core(void) {
+    return this_cpu_read(current_cpu);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define TLB_VECTOR 0x7A
+
+#define TLB_MAX_PCID 4095
+#define TLB_CR3_NOFLUSH (1ul << 63)
+
+#define CPUID_FEAT_ECX_PCID (1 << 17)
+
+/* ranges longer than this reload cr3 instead of going page by page */
+#define TLB_FLUSH_ALL_PAGES 32
+#define TLB_BATCH_FREE 16
+
+/*
+ * Changes to a page map are collected in a batch and flushed once, on
+ * every core that may have the map cached. Frames and page tables that
+ * were unmapped are only freed after the flush.
+ */
+struct tlb_batch {
+    uintptr_t *pml4;
+    uintptr_t start, end;
+    size_t free_count;
+    struct {
+        void *phys;
+        size_t pages;
+    } free[TLB_BATCH_FREE];
+};
+
+void tlb_install(void);
+void tlb_cpu_install(void);
+void tlb_switch(uintptr_t *pm);
+void tlb_shootdown(uintptr_t *pml4, uintptr_t start, uintptr_t end);
+void tlb_batch_init(struct tlb_batch *batch, uintptr_t *pml4);
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t virt, size_t size);
+void tlb_batch_free(struct tlb_batch *batch, void *phys, size_t pages);
+void tlb_batch_flush(struct tlb_batch *batch);
@@ -1,5 +1,7 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 
 int tsc_install(void);
-void tsc_sleep(size_t us);
\ No newline at end of file
+void tsc_sleep(size_t us);
+uint64_t tsc_read(void);
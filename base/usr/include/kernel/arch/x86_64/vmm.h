@@ -1,5 +1,8 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <kernel/arch/x86_64/smp.h>
 
 #define PTE_ADDR_MASK 0x000ffffffffff000
 #define PTE_GET_ADDR(x) ((x) & PTE_ADDR_MASK)
@@ -10,14 +13,29 @@
 #define PTE_USER     4ul
 #define PTE_WT       8ul
 #define PTE_CD       16ul
+#define PTE_HUGE     128ul /* in a pd entry: maps 2 MiB directly */
+#define PTE_COW      512ul /* available bit: write fault copies the page */
 #define PTE_NX (1ul << 63)
 
 #define KERNEL_VIRT_BASE 0xFFFF800000000000
 #define KERNEL_PHYS_BASE 0x100000
 
+/* bookkeeping for a page map, kept in the page right after its pml4 */
+struct vmm_space {
+    _Atomic uint32_t cpus; /* cores that may have tlb entries for it */
+
+    /* per core pcid, only valid while the generation matches the core's */
+    uint16_t pcid[SMP_MAX_CORES];
+    uint32_t pcid_gen[SMP_MAX_CORES];
+};
+
+#define VMM_SPACE(pml4) ((struct vmm_space *)((uintptr_t)(pml4) + 0x1000))
+
 extern uintptr_t *pml;
 extern uintptr_t *kernel_pd;
 
 void pmm_install(void);
+void pmm_remap(void);
 void vmm_install(void);
-void vmm_switch_pm(uintptr_t *pm);
\ No newline at end of file
+void vmm_switch_pm(uintptr_t *pm);
+bool vmm_handle_fault(uintptr_t virt, uint64_t error);
\ No newline at end of file
@@ -1,6 +1,6 @@
 #pragma once
 #include <stddef.h>
-#include <stdatomic.h>
+#include <kernel/spinlock.h>
 
 struct fifo {
     int *data;
@@ -8,7 +8,7 @@ struct fifo {
     int tail;
     int count;
     int size;
-    atomic_flag lock;
+    spinlock_t lock;
 };
 
 void fifo_init(struct fifo *fifo, int size);
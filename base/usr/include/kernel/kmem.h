@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <kernel/arch/x86_64/smp.h>
+
+#define KMEM_CPU_LIMIT 16
+#define KMEM_CPU_BATCH 8
+
+struct kmem_slab {
+    struct kmem_slab *next;
+    struct kmem_slab *prev;
+    struct kmem_cache *cache;
+    void *free;
+    uint32_t used;
+    uint32_t magic;
+};
+
+struct kmem_cpu {
+    void *free;
+    uint32_t count;
+};
+
+struct kmem_cache {
+    const char *name;
+    size_t size;
+    size_t slot;
+    size_t slab_pages;
+    uint32_t count;
+    void (*ctor)(void *obj);
+    struct kmem_slab *partial;
+    struct kmem_slab *full;
+    atomic_flag lock;
+    struct kmem_cpu cpu[SMP_MAX_CORES];
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void  kmem_cache_free(struct kmem_cache *cache, void *obj);
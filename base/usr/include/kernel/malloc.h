@@ -2,16 +2,29 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
+#define HEAP_MIN_SIZE 8
+#define HEAP_MAX_SIZE 1024 /* a 2048 byte class would fit only once in a page next to the header */
+#define HEAP_CLASSES  8
+
+/* header at the start of every slab page and large allocation */
 struct heap_block {
     struct heap_block *next;
     struct heap_block *prev;
+    struct heap *heap;
     uint32_t size; 
     uint32_t magic;
+    void *free;
+    uint32_t used;
+    uint32_t count;
 };
 
 struct heap {
-    struct heap_block *head;
+    struct heap_block *slabs[HEAP_CLASSES];
+    struct heap_block *full[HEAP_CLASSES];
+    struct heap_block *large;
+    atomic_flag lock;
 };
 
 extern struct heap *kernel_heap;
@@ -23,4 +36,4 @@ void  create_kernel_heap(void);
 struct heap *heap_create();
 void  heap_delete(struct heap *h);
 void *heap_alloc(struct heap *h, uint64_t n);
-void  heap_free(void *ptr);
\ No newline at end of file
+void  heap_free(void *ptr);
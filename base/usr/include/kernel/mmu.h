@@ -2,6 +2,7 @@
 #include "kernel/sched.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #ifdef __x86_64__
 #include <kernel/arch/x86_64/vmm.h>
@@ -27,15 +28,24 @@ extern uintptr_t *kernel_pd;
 extern uint64_t mmu_page_count;
 extern uint64_t mmu_usable_mem;
 extern uint64_t mmu_used_pages;
+extern uintptr_t mmu_zero_page;
 
 void *mmu_alloc(size_t page_count);
+void *mmu_try_alloc(size_t page_count);
 void  mmu_free(void *ptr, size_t page_count);
+void  mmu_page_ref(void *ptr);
+uint16_t mmu_page_refs(void *ptr);
+uint32_t *mmu_table_count(void *ptr);
 void  mmu_map_huge(uintptr_t virt, uintptr_t phys, uint64_t flags);
+bool  mmu_fault_huge(uintptr_t virt, uint64_t flags);
 void  mmu_map(void *virt, void *phys, uint64_t flags);
 void  mmu_unmap(void *virt);
 void  mmu_mark_used(void *ptr, size_t page_size);
 void  mmu_map_pages(size_t count, void *virt, void *phys, uint64_t flags);
 void  mmu_unmap_pages(size_t count, void *virt);
+void  mmu_release_pages(size_t count, void *virt);
+void  mmu_protect_pages(size_t count, void *virt, uint64_t flags);
+void  mmu_share_pages(uintptr_t *dest, uintptr_t *src, size_t count, void *virt);
 void  mmu_destroy_user_pm(uintptr_t *pml4);
 uintptr_t mmu_get_physical(uintptr_t *pml4, uintptr_t virt);
 uintptr_t *mmu_create_user_pm(struct task *proc);
\ No newline at end of file
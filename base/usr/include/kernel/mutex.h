@@ -2,19 +2,16 @@
 #include <stdatomic.h>
 #include <kernel/sched.h>
 
-typedef struct mutex_list {
-    struct task *proc;
-    struct mutex_list *next;
-    struct mutex_list *last;
-} mutex_list_t;
+#define MUTEX_SPIN_LIMIT 1000 /* pause loops spent waiting on a running owner before sleeping */
 
 typedef struct mutex {
     int locked;
     struct task *owner;
-    struct mutex_list *queue;
+    struct task *wait_head; /* linked through task->mutex_next */
+    struct task *wait_tail;
     atomic_flag lock;
 } mutex_t;
 
 void mutex_init(mutex_t *m);
 void mutex_lock(mutex_t *m);
-void mutex_unlock(mutex_t *m);
\ No newline at end of file
+void mutex_unlock(mutex_t *m);
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Readers walk rcu protected data without taking locks. Writers unlink
+ * objects with rcu_assign() and hand them to call_rcu(), which frees
+ * them once every reader that could still see them has left its
+ * read-side section. Readers may sleep inside the section, that only
+ * delays the free.
+ */
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+#define rcu_dereference(p)  __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+int rcu_read_lock(void);
+void rcu_read_unlock(int epoch);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_poll(void);
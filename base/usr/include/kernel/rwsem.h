@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include <stdatomic.h>
+#include <kernel/wait.h>
+
+/*
+ * Sleeping reader-writer lock for sections that may block, like file
+ * contents going through a disk driver. A queued writer keeps new
+ * readers out so it can't be starved.
+ */
+typedef struct rwsem {
+    int32_t readers;          /* active readers, -1 while a writer holds it */
+    uint32_t writers_waiting;
+    struct wait_queue wait;
+    atomic_flag lock;
+} rwsem_t;
+
+void rwsem_init(rwsem_t *s);
+void rwsem_read_lock(rwsem_t *s);
+void rwsem_read_unlock(rwsem_t *s);
+void rwsem_write_lock(rwsem_t *s);
+void rwsem_write_unlock(rwsem_t *s);
@@ -16,6 +16,12 @@
 #define USER_MAX_CHILDS 16
 #define USER_MAX_FDS    16
 
+#define SCHED_WAKE_VECTOR      0x7B /* ipi telling an idle core there is work */
+#define SCHED_SLICE_US         5000 /* longest a task runs before being preempted */
+#define SCHED_BALANCE_INTERVAL 20  /* scheduler passes between periodic balancing */
+#define SCHED_BALANCE_MAX      4   /* tasks moved per balancing pass */
+#define SCHED_LOAD_SCALE       256 /* fixed point unit of cpu->load_avg */
+
 enum task_state {
     TASK_RUNNING,
     TASK_PAUSED,
@@ -26,10 +32,19 @@ enum task_state {
     TASK_BLOCKING_IO
 };
 
+enum task_policy {
+    SCHED_POLICY_OTHER = 0,
+    SCHED_POLICY_FIFO = 1,
+    SCHED_POLICY_RR = 2,
+    SCHED_POLICY_BATCH = 3
+};
+
 struct task_time {
     uint64_t start;
     uint64_t end;
     uint64_t last;
+    uint64_t total;    /* hpet ticks spent running */
+    uint64_t vruntime; /* total scaled by the task's weight */
 };
 
 struct task_section {
@@ -37,14 +52,13 @@ struct task_section {
     size_t length;
 };
 
+/* syscall_entry in user.S knows the offsets of stack, kernel_stack and ctx.rflags */
 struct task {
     uint64_t stack;
     uint64_t kernel_stack;
-    uint64_t gs;
     uint64_t fs;
     struct registers ctx;
-    char align[8];
-    char fxsave[512];
+    char fxsave[512] __attribute__((aligned(16)));
 
     struct task *next;
     struct task *prev;
@@ -69,11 +83,31 @@ struct task {
     struct task *children;
     int child_exit;
     bool doing_blocking_io;
+    struct task *vfork_parent; /* address space is borrowed from this task */
+    struct task *vfork_child;
+
+    struct cpu *core;        /* core whose run queue the task lives on */
+    struct task *rq_next;
+    struct task *rq_prev;
+    bool queued;
+    int32_t heap_index;      /* position in the core's fair or sleep heap, -1 if on neither */
+    bool yielded;
+    uint32_t preempt_count;  /* the core's count while the task is switched out */
+    struct task *mutex_next; /* next waiter on the mutex this task sleeps on */
+
+    enum task_policy policy;
+    int nice;                /* -20 to 19 */
+    int rt_priority;         /* 1 to 99 for SCHED_POLICY_FIFO and SCHED_POLICY_RR */
 };
 
-#define this this_core()->current_proc
+DECLARE_PER_CPU(struct task *, current_task);
+
+#define this this_cpu_read(current_task)
 #define process_list this_core()->processes
 
+extern struct kmem_cache *task_cache;
+extern struct wait_queue vfork_wait; /* parents sleeping in vfork() */
+
 void sched_install(void);
 void sched_start_all_cores(void);
 void sched_yield(void);
@@ -81,10 +115,15 @@ void sched_lock(void);
 void sched_unlock(void);
 void sched_block(enum task_state reason);
 void sched_unblock(struct task *proc);
-void sched_sleep(int us);
+void sched_wake(struct task *proc, enum task_state state);
+struct task *sched_find_task(long pid);
+long sched_set_policy(struct task *proc, enum task_policy policy, int rt_priority);
+long sched_set_nice(struct task *proc, int nice);
+void sched_sleep(size_t us);
 void sched_kill(struct task *proc, int status);
 void sched_idle(void);
 void sched_add_task(struct task *proc, struct cpu *core);
 void sched_unblock_all_io(void);
+void sched_vfork_done(struct task *proc);
 struct task *sched_new_task(void *entry, const char *name);
 struct task *sched_new_user_task(void *entry, const char *name, int argc, char *argv[], char *env[]);
\ No newline at end of file
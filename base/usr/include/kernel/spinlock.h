@@ -1,5 +1,60 @@
 #pragma once
+#include <stdint.h>
+#include <stdbool.h>
 #include <stdatomic.h>
 
 void acquire(atomic_flag *lock);
-void release(atomic_flag *lock);
\ No newline at end of file
+void release(atomic_flag *lock);
+uint64_t irq_save(void);
+void irq_restore(uint64_t flags);
+uint64_t acquire_irqsave(atomic_flag *lock);
+void release_irqrestore(atomic_flag *lock, uint64_t flags);
+
+/* contention counters for one spinlock, shown in /dev/lockstat */
+struct lock_stats {
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;  /* acquisitions that had to wait */
+    uint64_t spins;
+    uint64_t max_hold;   /* tsc cycles */
+    uint64_t locked_at;
+    bool listed;
+    struct lock_stats *next;
+};
+
+/* ticket lock, cpus get the lock in the order they asked for it */
+typedef struct spinlock {
+    uint32_t next;  /* ticket for the next cpu to arrive */
+    uint32_t owner; /* ticket allowed in */
+    struct lock_stats *stats; /* NULL if the lock isn't profiled */
+} spinlock_t;
+
+#define SPINLOCK_INIT            { 0, 0, NULL }
+#define SPINLOCK_INIT_STATS(s)   { 0, 0, &(s) }
+#define LOCK_STATS_INIT(lock_name) { .name = (lock_name) }
+
+void spin_init(spinlock_t *lock);
+void spin_lock(spinlock_t *lock);
+bool spin_trylock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+uint64_t spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags);
+
+/*
+ * Spinning reader-writer lock for short sections that never sleep,
+ * anything that may block takes a rwsem_t instead. A waiting writer
+ * keeps new readers out, so a steady stream of readers can't starve it.
+ */
+typedef struct rwlock {
+    uint32_t state;
+} rwlock_t;
+
+#define RWLOCK_WRITER  (1u << 31)
+#define RWLOCK_WAITING (1u << 30)
+#define RWLOCK_INIT    { 0 }
+
+void rwlock_init(rwlock_t *lock);
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
@@ -9,6 +9,7 @@
 #define SYS_poll            7
 #define SYS_lseek           8
 #define SYS_mmap            9
+#define SYS_mprotect        10
 #define SYS_munmap          11
 #define SYS_brk             12
 #define SYS_rt_sigaction    13
@@ -16,9 +17,12 @@
 #define SYS_ioctl           16
 #define SYS_writev          20
 #define SYS_access          21
+#define SYS_sched_yield     24
 #define SYS_dup             32
+#define SYS_nanosleep       35
 #define SYS_getpid          39
 #define SYS_clone           56
+#define SYS_vfork           58
 #define SYS_execve          59
 #define SYS_exit            60
 #define SYS_wait4           61
@@ -32,6 +36,13 @@
 #define SYS_getegid         108
 #define SYS_getppid         110
 #define SYS_getpgid         121
+#define SYS_getpriority     140
+#define SYS_setpriority     141
+#define SYS_sched_getparam  143
+#define SYS_sched_setscheduler 144
+#define SYS_sched_getscheduler 145
+#define SYS_sched_get_priority_max 146
+#define SYS_sched_get_priority_min 147
 #define SYS_arch_prctl      158
 #define SYS_sethostname     170
 #define SYS_gettid          186
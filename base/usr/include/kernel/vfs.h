@@ -3,6 +3,8 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdatomic.h>
+#include <kernel/rcu.h>
+#include <kernel/rwsem.h>
 
 #define MAX_PATH            256
 #define MAX_NESTED_SYMLINKS 10
@@ -24,12 +26,17 @@ typedef struct vfs_node {
     uint16_t perms;
     uint64_t inode;
     struct vfs_node *parent;
-    struct vfs_node *children;
+    struct vfs_node *children; /* rcu protected, walk under rcu_read_lock() */
     struct vfs_node *next;
     long(*read)(struct vfs_node *node, void *buffer, long offset, size_t len);
     long(*write)(struct vfs_node *node, void *buffer, long offset, size_t len);
     char *symlink_target;
-    atomic_flag lock;
+    rwsem_t lock;         /* file contents */
+    struct rcu_head rcu;
+    uintptr_t *cache; /* physical pages shared by read-only mappings, by file page */
+    size_t cache_pages;
+    uint32_t mappings;    /* vma blocks backed by the file, see vfs_map_get() */
+    atomic_flag cache_lock;
 } vfs_node_t;
 
 extern struct vfs_node *vfs_root;
@@ -46,4 +53,8 @@ int vfs_close(struct vfs_node *node);
 struct vfs_node *vfs_create_symlink(const char *name, const char *target);
 struct vfs_node *vfs_resolve_symlink(struct vfs_node *symlink, int max_depth);
 bool vfs_poll(struct vfs_node *node);
+uintptr_t vfs_cache_page(struct vfs_node *node, uint64_t offset);
+void vfs_cache_drop(struct vfs_node *node);
+void vfs_map_get(struct vfs_node *node);
+void vfs_map_put(struct vfs_node *node);
 int vfs_remove_node(struct vfs_node *node);
\ No newline at end of file
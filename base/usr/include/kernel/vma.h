@@ -7,21 +7,35 @@
 
 struct vma_head {
     struct vma_block *head;
+    struct vma_block *root;
+    uintptr_t next_virt; /* where the next mapping without an address goes */
 };
 
 struct vma_block {
     struct vma_block *next;
     struct vma_block *prev;
+    struct vma_block *parent;
+    struct vma_block *left;
+    struct vma_block *right;
+    bool red;
     size_t size;
     size_t checksum;
     uintptr_t phys;
     uintptr_t virt;
     uint64_t flags;
+    struct vfs_node *file; /* pages are read from here on first touch */
+    uint64_t file_offset;
+    uint64_t file_size; /* the rest of the block is zero filled */
 };
 
+void vma_install(void);
 struct vma_head *vma_create(void);
 void vma_destroy(struct vma_head *h);
 void *vma_map(struct vma_head *h, uint64_t pages, uint64_t phys, uint64_t virt, uint64_t flags);
-void vma_unmap(struct vma_block *block);
-void vma_copy_mappings(struct vma_head *dest, struct vma_head *src);
-bool vma_unmap_addr(struct vma_head *h, void *virt);
\ No newline at end of file
+void *vma_map_file(struct vma_head *h, uint64_t pages, uint64_t virt, uint64_t flags, struct vfs_node *file, uint64_t offset, uint64_t size);
+void vma_unmap(struct vma_head *h, struct vma_block *block);
+void vma_unmap_range(struct vma_head *h, uintptr_t virt, uint64_t pages);
+bool vma_protect(struct vma_head *h, uintptr_t virt, uint64_t pages, uint64_t flags);
+void vma_copy_mappings(struct vma_head *dest, struct vma_head *src, uintptr_t *dest_pml4, uintptr_t *src_pml4);
+bool vma_unmap_addr(struct vma_head *h, void *virt);
+bool vma_handle_fault(struct vma_head *h, uintptr_t virt, bool write);
\ No newline at end of file
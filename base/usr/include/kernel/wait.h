@@ -0,0 +1,46 @@
+#pragma once
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* wait_event() expands to scheduler calls, users include kernel/sched.h too */
+struct task;
+
+/* lives on the waiting task's stack for as long as it waits */
+struct wait_queue_entry {
+    struct task *proc;
+    struct wait_queue_entry *next;
+    struct wait_queue_entry *prev;
+    bool queued;
+};
+
+struct wait_queue {
+    struct wait_queue_entry *head;
+    struct wait_queue_entry *tail;
+    atomic_flag lock;
+};
+
+void wait_queue_init(struct wait_queue *wq);
+void wait_prepare(struct wait_queue *wq, struct wait_queue_entry *entry);
+void wait_finish(struct wait_queue *wq, struct wait_queue_entry *entry);
+void wake_up(struct wait_queue *wq);
+void wake_up_one(struct wait_queue *wq);
+
+/*
+ * Sleep until cond is true. The task is queued and marked blocked before
+ * cond is checked, so a wake_up() in between makes it runnable again
+ * instead of being lost. Preemption is off meanwhile so the task can't
+ * be switched out while it is marked blocked but not yet waiting.
+ */
+#define wait_event(wq, cond) do {                               \
+    struct wait_queue_entry __wait = { .proc = this };          \
+    for (;;) {                                                  \
+        sched_lock();                                           \
+        wait_prepare((wq), &__wait);                            \
+        if (cond)                                               \
+            break;                                              \
+        sched_yield();                                          \
+        sched_unlock();                                         \
+    }                                                           \
+    wait_finish((wq), &__wait);                                 \
+    sched_unlock();                                             \
+} while (0)
@@ -27,8 +27,37 @@ size_t hpet_get_ticks(void) {
     return hpet_read(HPET_REG_MAIN_COUNTER);
 }
 
+/*
+ * a * b / c with a 128 bit product, in 64 bits the conversions below
+ * overflow after a few hours. Saturates instead of faulting when the
+ * quotient doesn't fit.
+ */
+static uint64_t hpet_mul_div(uint64_t a, uint64_t b, uint64_t c, uint64_t *rem) {
+    uint64_t lo, hi, q, r;
+    asm ("mulq %3" : "=a"(lo), "=d"(hi) : "a"(a), "rm"(b) : "cc");
+    if (hi >= c) {
+        *rem = 0;
+        return UINT64_MAX;
+    }
+    asm ("divq %4" : "=a"(q), "=d"(r) : "a"(lo), "d"(hi), "rm"(c) : "cc");
+    *rem = r;
+    return q;
+}
+
+size_t hpet_us_to_ticks(size_t us) {
+    uint64_t rem;
+    return hpet_mul_div(us, 1000000000, hpet_period, &rem);
+}
+
+/* rounded up, so waiting that long never ends early */
+size_t hpet_ticks_to_us(size_t ticks) {
+    uint64_t rem;
+    uint64_t us = hpet_mul_div(ticks, hpet_period, 1000000000, &rem);
+    return rem && us != UINT64_MAX ? us + 1 : us;
+}
+
 void hpet_sleep(size_t us) {
-    size_t end_ticks = hpet_read(HPET_REG_MAIN_COUNTER) + us * 1000000000 / hpet_period;
+    size_t end_ticks = hpet_read(HPET_REG_MAIN_COUNTER) + hpet_us_to_ticks(us);
 
     while (hpet_read(HPET_REG_MAIN_COUNTER) < end_ticks) {
         asm ("pause" : : : "memory");
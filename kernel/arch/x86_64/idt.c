@@ -100,6 +100,14 @@ void isr_handler(struct registers *r) {
     if (r->int_no == 0xff) {
         return;
     }
+
+    uint64_t cr2;
+    asm volatile("mov %%cr2, %0" : "=r" (cr2));
+
+    if (r->int_no == 14 && vmm_handle_fault(cr2, r->error_code)) {
+        return;
+    }
+
     if ((r->cs & 3) == 0x3) {
         fprintf(1, "%s:%d: Segmentation fault on PID %d\n", __FILE__, __LINE__, this->pid);
         //sched_kill(this, 11);
@@ -112,9 +120,6 @@ void isr_handler(struct registers *r) {
 	    for (;;) asm ("hlt");
     }
 
-    uint64_t cr2;
-    asm volatile("mov %%cr2, %0" : "=r" (cr2));
-
     uint8_t bspid;
     asm volatile ("mov $1, %%eax; cpuid; shrl $24, %%ebx;": "=b"(bspid) : :);
 
@@ -48,6 +48,20 @@ void lapic_oneshot(uint8_t vector, uint32_t ms) {
     lapic_write(LAPIC_TIMER_INITCNT, lapic_ticks * ms);
 }
 
+void lapic_oneshot_us(uint8_t vector, uint64_t us) {
+    uint64_t count = lapic_ticks * us / 1000;
+    if (count == 0)
+        count = 1;
+    if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+
+    lapic_stop_timer();
+
+    lapic_write(LAPIC_TIMER_DIV, 0);
+    lapic_write(LAPIC_TIMER_LVT, vector);
+    lapic_write(LAPIC_TIMER_INITCNT, count);
+}
+
 void lapic_eoi(void) {
     lapic_write((uint8_t)LAPIC_EOI, 0);
 }
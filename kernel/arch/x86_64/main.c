@@ -5,6 +5,7 @@
 #include <kernel/arch/x86_64/ps2.h>
 #include <kernel/arch/x86_64/vga.h>
 #include <kernel/arch/x86_64/tsc.h>
+#include <kernel/arch/x86_64/tlb.h>
 #include <kernel/arch/x86_64/hpet.h>
 #include <kernel/arch/x86_64/user.h>
 #include <kernel/arch/x86_64/lapic.h>
@@ -32,7 +33,8 @@ extern void generic_main(void);
 
 void *mboot = NULL;
 
-atomic_flag flanterm_lock = ATOMIC_FLAG_INIT;
+static struct lock_stats flanterm_lock_stats = LOCK_STATS_INIT("flanterm");
+spinlock_t flanterm_lock = SPINLOCK_INIT_STATS(flanterm_lock_stats);
 
 void *mboot2_find_next(char *current, uint32_t type) {
 	char *header = current;
@@ -66,9 +68,9 @@ void putchar(char c) {
 	if (!ft_ctx) {
 		vga_putchar(c);
 	} else {
-		acquire(&flanterm_lock);
+		uint64_t flags = spin_lock_irqsave(&flanterm_lock);
 		flanterm_write(ft_ctx, &c, 1);
-		release(&flanterm_lock);
+		spin_unlock_irqrestore(&flanterm_lock, flags);
 	}
 }
 
@@ -76,9 +78,9 @@ void puts(char *s) {
 	if (!ft_ctx) {
 		vga_puts(s);
 	} else {
-		acquire(&flanterm_lock);
+		uint64_t flags = spin_lock_irqsave(&flanterm_lock);
 		flanterm_write(ft_ctx, s, strlen(s));
-		release(&flanterm_lock);
+		spin_unlock_irqrestore(&flanterm_lock, flags);
 	}
 }
 
@@ -149,6 +151,7 @@ void kmain(void *mboot_info, uint32_t mboot_magic) {
 	hpet_install();
 	lapic_calibrate_timer();
 	smp_initialize();
+	tlb_install();
 	user_initialize();
 
 	generic_startup();
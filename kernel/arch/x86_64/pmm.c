@@ -1,22 +1,237 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdatomic.h>
+#include <kernel/arch/x86_64/smp.h>
 #include <kernel/arch/x86_64/vmm.h>
 #include <kernel/mmu.h>
 #include <kernel/panic.h>
-#include <kernel/bitmap.h>
 #include <kernel/string.h>
 #include <kernel/printf.h>
 #include <kernel/spinlock.h>
 #include <kernel/multiboot.h>
 
-uint8_t *pmm_bitmap = NULL;
-uint64_t pmm_bitmap_size = 0;
+/*
+ * Buddy allocator. Free memory is kept in blocks of 2^order pages on
+ * per-order free lists. The list links live in a page frame array
+ * placed after the kernel, modules and multiboot info.
+ *
+ * Single pages go through a small per-CPU cache in struct cpu which is
+ * refilled from and drained to the free lists in batches, so most
+ * page table and stack page churn never touches pmm_lock.
+ *
+ * Pages shared copy-on-write carry a count of their extra owners;
+ * freeing a shared page just drops one reference. The zero page is
+ * never counted or freed.
+ *
+ * Page tables keep the number of their present entries in the frame
+ * array too, so emptied tables can be freed without scanning them.
+ */
+
+#define PMM_MAX_ORDER 16
+#define PMM_NONE 0xFFFFFFFF
+
+#define PMM_FREE 1 /* page is not allocated */
+#define PMM_HEAD 2 /* page heads a free block of pmm_page.order */
+#define PMM_CACHED 4 /* page sits in a per-CPU page cache */
+
+struct pmm_page {
+    union {
+        struct {
+            uint32_t next;
+            uint32_t prev;
+        };
+        uint32_t table_count; /* allocated page tables: present entries */
+    };
+    uint8_t order;
+    uint8_t flags;
+    uint16_t refs;
+};
+
+struct pmm_page *pmm_pages = NULL;
+uint64_t pmm_pages_size = 0;
+uint32_t pmm_free_lists[PMM_MAX_ORDER + 1];
 uint64_t mmu_page_count = 0;
 uint64_t mmu_usable_mem = 0;
 uint64_t mmu_used_pages = 0;
+uintptr_t mmu_zero_page = 0;
+
+static struct lock_stats pmm_lock_stats = LOCK_STATS_INIT("pmm");
+spinlock_t pmm_lock = SPINLOCK_INIT_STATS(pmm_lock_stats);
+
+static void pmm_list_add(uint32_t pfn, int order) {
+    pmm_pages[pfn].order = order;
+    pmm_pages[pfn].flags |= PMM_HEAD;
+    pmm_pages[pfn].prev = PMM_NONE;
+    pmm_pages[pfn].next = pmm_free_lists[order];
+    if (pmm_free_lists[order] != PMM_NONE)
+        pmm_pages[pmm_free_lists[order]].prev = pfn;
+    pmm_free_lists[order] = pfn;
+}
+
+static void pmm_list_remove(uint32_t pfn) {
+    struct pmm_page *page = &pmm_pages[pfn];
+
+    if (page->prev != PMM_NONE)
+        pmm_pages[page->prev].next = page->next;
+    else
+        pmm_free_lists[page->order] = page->next;
+    if (page->next != PMM_NONE)
+        pmm_pages[page->next].prev = page->prev;
+    page->flags &= ~PMM_HEAD;
+}
+
+static void pmm_free_block(uint64_t pfn, int order) {
+    /* merge with the buddy for as long as it is a free block of the same order */
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ul << order);
+        if (buddy >= mmu_page_count ||
+            !(pmm_pages[buddy].flags & PMM_HEAD) ||
+            pmm_pages[buddy].order != order)
+            break;
+
+        pmm_list_remove(buddy);
+        pfn &= ~(1ul << order);
+        order++;
+    }
+    pmm_list_add(pfn, order);
+}
+
+static void pmm_free_range(uint64_t pfn, uint64_t count) {
+    while (count) {
+        int order = pfn ? __builtin_ctzl(pfn) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER)
+            order = PMM_MAX_ORDER;
+        while ((1ul << order) > count)
+            order--;
+
+        pmm_free_block(pfn, order);
+        pfn += 1ul << order;
+        count -= 1ul << order;
+    }
+}
+
+static uint64_t pmm_alloc_pages(uint64_t count) {
+    int order = 0;
+    while ((1ul << order) < count)
+        order++;
+    if (order > PMM_MAX_ORDER)
+        return 0;
+
+    int k = order;
+    while (k <= PMM_MAX_ORDER && pmm_free_lists[k] == PMM_NONE)
+        k++;
+    if (k > PMM_MAX_ORDER)
+        return 0;
+
+    uint64_t pfn = pmm_free_lists[k];
+    pmm_list_remove(pfn);
+
+    /* split the block, keeping the lower half each time */
+    while (k > order) {
+        k--;
+        pmm_list_add(pfn + (1ul << k), k);
+    }
+
+    /* give back the tail the caller didn't ask for */
+    pmm_free_range(pfn + count, (1ul << order) - count);
+
+    for (uint64_t i = 0; i < count; i++)
+        pmm_pages[pfn + i].flags &= ~PMM_FREE;
+    return pfn;
+}
+
+static bool pmm_take_page(uint64_t pfn) {
+    if (pfn >= mmu_page_count || !(pmm_pages[pfn].flags & PMM_FREE))
+        return false;
+
+    /* find the free block containing the page */
+    int k;
+    uint64_t head = pfn;
+    for (k = 0; k <= PMM_MAX_ORDER; k++) {
+        head = pfn & ~((1ul << k) - 1);
+        if ((pmm_pages[head].flags & PMM_HEAD) && pmm_pages[head].order == k)
+            break;
+    }
+    if (k > PMM_MAX_ORDER)
+        return false;
+
+    /* split it down, returning the halves that don't contain the page */
+    pmm_list_remove(head);
+    while (k > 0) {
+        k--;
+        if (pfn >= head + (1ul << k)) {
+            pmm_list_add(head, k);
+            head += 1ul << k;
+        } else {
+            pmm_list_add(head + (1ul << k), k);
+        }
+    }
+
+    pmm_pages[pfn].flags &= ~PMM_FREE;
+    return true;
+}
+
+static uint64_t pmm_cache_alloc(void) {
+    uint64_t flags = irq_save();
+    struct cpu *core = this_core();
+
+    if (!core->page_cache_count) {
+        spin_lock(&pmm_lock);
+        while (core->page_cache_count < SMP_PAGE_CACHE_BATCH) {
+            uint64_t pfn = pmm_alloc_pages(1);
+            if (!pfn)
+                break;
+            pmm_pages[pfn].flags |= PMM_CACHED;
+            core->page_cache[core->page_cache_count++] = pfn;
+        }
+        spin_unlock(&pmm_lock);
+    }
+
+    uint64_t pfn = 0;
+    if (core->page_cache_count) {
+        pfn = core->page_cache[--core->page_cache_count];
+        pmm_pages[pfn].flags &= ~PMM_CACHED;
+    }
+
+    irq_restore(flags);
+    return pfn;
+}
+
+static void pmm_cache_free(uint64_t pfn) {
+    uint64_t flags = irq_save();
+    struct cpu *core = this_core();
+
+    if (core->page_cache_count == SMP_PAGE_CACHE_SIZE) {
+        spin_lock(&pmm_lock);
+        for (int i = 0; i < SMP_PAGE_CACHE_BATCH; i++) {
+            uint64_t page = core->page_cache[--core->page_cache_count];
+            pmm_pages[page].flags = (pmm_pages[page].flags & ~PMM_CACHED) | PMM_FREE;
+            pmm_free_range(page, 1);
+        }
+        spin_unlock(&pmm_lock);
+    }
+
+    pmm_pages[pfn].flags |= PMM_CACHED;
+    core->page_cache[core->page_cache_count++] = pfn;
+
+    irq_restore(flags);
+}
+
+static uintptr_t pmm_reserved_end(void *mboot, uintptr_t reserved_end) {
+    struct multiboot_tag_module *mod = mboot2_find_tag(mboot, MULTIBOOT_TAG_TYPE_MODULE);
+    while (mod) {
+        if (mod->mod_end > reserved_end)
+            reserved_end = mod->mod_end;
+        mod = mboot2_find_next((char *)mod + ALIGN_UP(mod->size, 8), MULTIBOOT_TAG_TYPE_MODULE);
+    }
 
-atomic_flag pmm_lock = ATOMIC_FLAG_INIT;
+    uintptr_t mboot_end = (uintptr_t)mboot + *(uint32_t *)mboot;
+    if (mboot_end > reserved_end)
+        reserved_end = mboot_end;
+
+    return ALIGN_UP(reserved_end, PAGE_SIZE);
+}
 
 void pmm_install(void) {
     extern void *mboot, end;
@@ -28,7 +243,7 @@ void pmm_install(void) {
     uint32_t i;
     for (i = 0; i < (mmap->size - sizeof(struct multiboot_tag_mmap)) / mmap->entry_size; i++) {
         mmmt = &mmap->entries[i];
-        
+
         if (mmmt->addr < KERNEL_PHYS_BASE) {
             mmmt->type = MULTIBOOT_MEMORY_RESERVED;
             continue;
@@ -39,22 +254,36 @@ void pmm_install(void) {
                 mmmt->len -= (uintptr_t)&end - KERNEL_PHYS_BASE;
                 mmmt->addr = (uintptr_t)&end;
             }
-            highest_address = mmmt->addr + mmmt->len;
+            if (mmmt->addr + mmmt->len > highest_address)
+                highest_address = mmmt->addr + mmmt->len;
         }
     }
 
-    pmm_bitmap = (uint8_t *)PAGE_SIZE;
     mmu_page_count = highest_address / PAGE_SIZE;
-    pmm_bitmap_size = ALIGN_UP(mmu_page_count / 8, PAGE_SIZE);
-    memset(pmm_bitmap, 0xFF, pmm_bitmap_size);
+    pmm_pages_size = ALIGN_UP(mmu_page_count * sizeof(struct pmm_page), PAGE_SIZE);
+    pmm_pages = (struct pmm_page *)pmm_reserved_end(mboot, (uintptr_t)&end);
+    if ((uintptr_t)pmm_pages + pmm_pages_size > highest_address)
+        panic("not enough memory for the page frame array");
+
+    /* every page starts out reserved until a memory map entry says otherwise */
+    memset(pmm_pages, 0, pmm_pages_size);
+    for (i = 0; i <= PMM_MAX_ORDER; i++) {
+        pmm_free_lists[i] = PMM_NONE;
+    }
 
     for (i = 0; i < (mmap->size - sizeof(struct multiboot_tag_mmap)) / mmap->entry_size; i++) {
         mmmt = &mmap->entries[i];
 
         if (mmmt->type == MULTIBOOT_MEMORY_AVAILABLE) {
-            for (uint64_t j = 0; j < mmmt->len; j += PAGE_SIZE) {
-                bitmap_clear(pmm_bitmap, (mmmt->addr + j) / PAGE_SIZE);
+            uint64_t first = ALIGN_UP(mmmt->addr, PAGE_SIZE) / PAGE_SIZE;
+            uint64_t last = (mmmt->addr + mmmt->len) / PAGE_SIZE;
+            if (last <= first)
+                continue;
+
+            for (uint64_t j = first; j < last; j++) {
+                pmm_pages[j].flags = PMM_FREE;
             }
+            pmm_free_range(first, last - first);
             mmu_usable_mem += mmmt->len;
         }
     }
@@ -66,79 +295,122 @@ void pmm_install(void) {
     }
 
 	mmu_mark_used(mboot, 2);
-    
-    dprintf("%s:%d: initialized bitmap at 0x%p\n", __FILE__, __LINE__, (uint64_t)pmm_bitmap);
+    mmu_mark_used(pmm_pages, pmm_pages_size / PAGE_SIZE);
+
+    dprintf("%s:%d: initialized page frame array at 0x%p\n", __FILE__, __LINE__, (uint64_t)pmm_pages);
     dprintf("%s:%d: usable memory: %luK\n", __FILE__, __LINE__, mmu_usable_mem / 1024 - mmu_used_pages * 4);
 }
 
-void mmu_mark_used(void *ptr, size_t page_count) {
-    for (size_t i = 0; i < page_count * PAGE_SIZE; i += PAGE_SIZE) {
-        bitmap_set(pmm_bitmap, ((uintptr_t)ptr + i) / PAGE_SIZE);
-    }
-    mmu_used_pages += page_count;
+void pmm_remap(void) {
+    /* the low identity map isn't present in user page maps */
+    pmm_pages = (struct pmm_page *)VIRTUAL_IDENT(pmm_pages);
 }
 
-uint64_t pmm_find_pages(uint64_t page_count) {
-    uint64_t pages = 0;
-    uint64_t first_page = 0;
+void mmu_mark_used(void *ptr, size_t page_count) {
+    uint64_t page = (uintptr_t)ptr / PAGE_SIZE;
 
-    for (uint64_t i = 0; i < mmu_page_count; i++) {
-        if (!bitmap_get(pmm_bitmap, i)) {
-            if (pages == 0) {
-                first_page = i;
-            }
-            pages++;
-            if (pages == page_count) {
-                for (uint64_t j = 0; j < page_count; j++) {
-                    acquire(&pmm_lock);
-                    bitmap_set(pmm_bitmap, first_page + j);
-                    release(&pmm_lock);
-                }
-
-                mmu_used_pages += page_count;
-                return first_page;
-            }
-        } else {
-            pages = 0;
-        }
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    for (size_t i = 0; i < page_count; i++) {
+        pmm_take_page(page + i);
     }
-    return 0;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    __atomic_add_fetch(&mmu_used_pages, page_count, __ATOMIC_RELAXED);
 }
 
-void *mmu_alloc(size_t page_count) {
-    uint64_t pages = pmm_find_pages(page_count);
-    
+/* like mmu_alloc, but returns NULL instead of panicking when memory runs out */
+void *mmu_try_alloc(size_t page_count) {
+    uint64_t pages;
+    if (page_count == 1) {
+        pages = pmm_cache_alloc();
+    } else {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        pages = pmm_alloc_pages(page_count);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
     if (!pages)
-        panic("allocation failed: out of memory");
+        return NULL;
+    __atomic_add_fetch(&mmu_used_pages, page_count, __ATOMIC_RELAXED);
 
     uint64_t phys_addr = pages * PAGE_SIZE;
-    
+
     return (void*)(phys_addr);
 }
 
-void mmu_free(void *ptr, size_t page_count) {
-    uint64_t page = (uint64_t)ptr / PAGE_SIZE;
+void *mmu_alloc(size_t page_count) {
+    void *phys = mmu_try_alloc(page_count);
+    if (!phys)
+        panic("allocation failed: out of memory");
+    return phys;
+}
 
-    if ((uintptr_t)ptr == 0x52b000) {
-        //panic("breakpoint");
+static bool pmm_page_unref(uint64_t pfn) {
+    uint16_t refs = __atomic_load_n(&pmm_pages[pfn].refs, __ATOMIC_ACQUIRE);
+    while (refs) {
+        if (__atomic_compare_exchange_n(&pmm_pages[pfn].refs, &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
     }
+    return false;
+}
+
+void mmu_page_ref(void *ptr) {
+    uint64_t page = (uint64_t)ptr / PAGE_SIZE;
+    if ((uintptr_t)ptr == mmu_zero_page)
+        return;
+    if (__atomic_add_fetch(&pmm_pages[page].refs, 1, __ATOMIC_ACQ_REL) == 0)
+        panic("reference count overflow @ 0x%p", ptr);
+}
+
+uint16_t mmu_page_refs(void *ptr) {
+    return __atomic_load_n(&pmm_pages[(uint64_t)ptr / PAGE_SIZE].refs, __ATOMIC_ACQUIRE);
+}
+
+/* the list links aren't used while a page is allocated, page tables keep their count there */
+uint32_t *mmu_table_count(void *ptr) {
+    return &pmm_pages[(uint64_t)ptr / PAGE_SIZE].table_count;
+}
+
+void mmu_free(void *ptr, size_t page_count) {
+    uint64_t page = (uint64_t)ptr / PAGE_SIZE;
 
-    if ((uintptr_t)ptr < KERNEL_PHYS_BASE || page > pmm_bitmap_size * 8) {
+    if ((uintptr_t)ptr < KERNEL_PHYS_BASE || page + page_count > mmu_page_count) {
         panic("invalid deallocation @ 0x%p", ptr);
         printf("%s:%d: invalid deallocation @ 0x%p\n", __FILE__, __LINE__, ptr);
         return;
     }
 
-    acquire(&pmm_lock);
+    if (page_count == 1) {
+        if ((uintptr_t)ptr == mmu_zero_page)
+            return;
+        if (pmm_pages[page].flags & (PMM_FREE | PMM_CACHED))
+            panic("double free @ 0x%p", ptr);
+        if (pmm_page_unref(page))
+            return;
+        __atomic_sub_fetch(&mmu_used_pages, 1, __ATOMIC_RELAXED);
+        pmm_cache_free(page);
+        return;
+    }
+
+    /* ranges with shared pages in them are freed page by page */
     for (uint64_t i = 0; i < page_count; i++) {
-        if (!bitmap_get(pmm_bitmap, page + i)) {
+        if (__atomic_load_n(&pmm_pages[page + i].refs, __ATOMIC_ACQUIRE)) {
+            for (uint64_t j = 0; j < page_count; j++)
+                mmu_free((void *)((page + j) * PAGE_SIZE), 1);
+            return;
+        }
+    }
+
+    __atomic_sub_fetch(&mmu_used_pages, page_count, __ATOMIC_RELAXED);
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    for (uint64_t i = 0; i < page_count; i++) {
+        if (pmm_pages[page + i].flags & (PMM_FREE | PMM_CACHED)) {
             panic("double free @ 0x%p", ptr);
             //dprintf("%s:%d: double free @ 0x%p\n", __FILE__, __LINE__, ptr);
             return;
         }
-        bitmap_clear(pmm_bitmap, page + i);
+        pmm_pages[page + i].flags |= PMM_FREE;
     }
-    release(&pmm_lock);
-    
-    mmu_used_pages -= page_count;
-}
\ No newline at end of file
+    pmm_free_range(page, page_count);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
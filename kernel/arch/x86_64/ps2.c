@@ -5,6 +5,7 @@
 #include <kernel/arch/x86_64/lapic.h>
 #include <kernel/acpi.h>
 #include <kernel/fifo.h>
+#include <kernel/wait.h>
 #include <kernel/sched.h>
 #include <kernel/printf.h>
 #include <kernel/string.h>
@@ -14,6 +15,7 @@ bool kb_caps = false;
 bool kb_ctrl = false;
 bool kb_shift = false;
 struct fifo kb_fifo;
+struct wait_queue kb_wait;
 
 void irq1_handler(struct registers *r) {
     uint8_t key = inb(0x60);
@@ -46,7 +48,7 @@ void irq1_handler(struct registers *r) {
                 } else {
                     fifo_enqueue(&kb_fifo, kb_map_keys[key]);
                 }
-                //sched_unblock_all_io();
+                wake_up(&kb_wait);
                 break;
         }
     } else {
@@ -65,11 +67,7 @@ void irq1_handler(struct registers *r) {
 
 int getchar(void) {
     int c = 0;
-    while (!fifo_dequeue(&kb_fifo, &c)) {
-        //sched_block(TASK_BLOCKING_IO);
-        //this->doing_blocking_io = true;
-        sched_yield();
-    }
+    wait_event(&kb_wait, fifo_dequeue(&kb_fifo, &c));
     return c;
 }
 
@@ -129,5 +127,6 @@ void ps2_initialize(void) {
 
 void ps2_install(void) {
     fifo_init(&kb_fifo, 64);
+    wait_queue_init(&kb_wait);
     irq_register(1, irq1_handler);
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <kernel/arch/x86_64/lapic.h>
 #include <kernel/vfs.h>
 #include <kernel/fifo.h>
+#include <kernel/wait.h>
 #include <kernel/sched.h>
 #include <kernel/string.h>
 #include <kernel/printf.h>
@@ -12,9 +13,11 @@
 
 #define COM1 0x3f8
 
-atomic_flag serial_lock = ATOMIC_FLAG_INIT;
+static struct lock_stats serial_lock_stats = LOCK_STATS_INIT("serial");
+spinlock_t serial_lock = SPINLOCK_INIT_STATS(serial_lock_stats);
 uint16_t serial_base = COM1;
 struct fifo serial_fifo;
+struct wait_queue serial_wait;
 
 void serial_install(void) {
     outb(COM1 + 1, 0x00);
@@ -45,9 +48,7 @@ int serial_is_data_ready(void) {
 
 char serial_read_char(void) {
     int c = 0;
-    while (!fifo_dequeue(&serial_fifo, &c)) {
-        sched_yield();
-    }
+    wait_event(&serial_wait, fifo_dequeue(&serial_fifo, &c));
     return c;
 }
 
@@ -59,11 +60,11 @@ void serial_write_char(char c) {
 }
 
 void serial_puts(char *str) {
-    acquire(&serial_lock);
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
     while (*str) {
         serial_write_char(*str++);
     }
-    release(&serial_lock);
+    spin_unlock_irqrestore(&serial_lock, flags);
 }
 
 int dprintf(const char *fmt, ...) {
@@ -127,6 +128,7 @@ void irq4_handler(struct registers *r) {
     if ((iir & 0x06) == 0x04) {
         int c = inb(COM1);
         fifo_enqueue(&serial_fifo, c);
+        wake_up(&serial_wait);
 
         if (c == '`') {
             serial_puts("\033[H\033[J");
@@ -138,6 +140,7 @@ void irq4_handler(struct registers *r) {
 
 void serial_initialize(void) {
     fifo_init(&serial_fifo, 64);
+    wait_queue_init(&serial_wait);
     irq_register(4, irq4_handler);
     outb(COM1 + 1, 0x01);
 
@@ -1,6 +1,7 @@
 #include <stdatomic.h>
 #include <kernel/arch/x86_64/gdt.h>
 #include <kernel/arch/x86_64/tss.h>
+#include <kernel/arch/x86_64/tlb.h>
 #include <kernel/arch/x86_64/idt.h>
 #include <kernel/arch/x86_64/smp.h>
 #include <kernel/arch/x86_64/vmm.h>
@@ -18,6 +19,8 @@
 #include <kernel/spinlock.h>
 
 extern void _L8000_ap_trampoline();
+extern char percpu_start_ld[];
+extern char percpu_end_ld[];
 
 volatile uint8_t smp_running_cpus = 1;
 static atomic_flag smp_init_lock = ATOMIC_FLAG_INIT;
@@ -30,6 +33,9 @@ struct cpu bsp = {
 };
 struct cpu *smp_cpu_list[SMP_MAX_CORES] = { &bsp };
 
+DEFINE_PER_CPU(struct cpu *, current_cpu) = &bsp;
+uintptr_t percpu_offset[SMP_MAX_CORES]; /* the bsp runs on the section itself */
+
 /*
  * https://wiki.osdev.org/Symmetric_Multiprocessing
  */
@@ -60,13 +66,38 @@ void smp_initialize(void) {
         struct cpu *core = (struct cpu *)kmalloc(sizeof(struct cpu));
         core->id = i;
         core->lapic_id = madt_lapic_list[i]->id;
+        core->loaded_pml4 = NULL;
+        core->pcid = false; /* until tlb_cpu_install(), ap_startup() loads cr3 before it */
+        core->pcid_next = 1;
+        core->pcid_gen = 1;
         core->processes = NULL;
         core->current_proc = NULL;
         core->terminated_processes = NULL;
+        core->rt_head = NULL;
+        core->rt_tail = NULL;
+        core->fair = (struct task_heap){ NULL, 0, 0 };
+        core->sleepers = (struct task_heap){ NULL, 0, 0 };
+        core->min_vruntime = 0;
+        core->nr_running = 0;
+        core->last_proc = NULL;
+        core->load_avg = 0;
+        core->balance_ticks = 0;
+        core->nr_switches = 0;
+        core->nr_migrations = 0;
+        core->preempt_count = 0;
+        core->need_resched = false;
+        core->page_cache_count = 0;
         release(&core->sched_lock);
         release(&core->vmm_lock);
         smp_cpu_list[i] = core;
 
+        /* starts out as a copy of the boot cpu's values */
+        size_t percpu_size = percpu_end_ld - percpu_start_ld;
+        void *percpu = kmalloc(percpu_size);
+        memcpy(percpu, percpu_start_ld, percpu_size);
+        percpu_offset[i] = (uintptr_t)percpu - (uintptr_t)percpu_start_ld;
+        per_cpu(current_cpu, i) = core;
+
         /* send INIT IPI */
         lapic_write(LAPIC_ESR, 0);                                                        /* clear APIC errors */
         lapic_write(LAPIC_ICRHI, i << LAPIC_ICDESTSHIFT);                                 /* select AP */
@@ -107,15 +138,16 @@ struct cpu *get_core(int core) {
     return smp_cpu_list[core];
 }
 
-struct cpu *this_core(void) {
-    uint8_t bspid;
-    asm volatile ("mov $1, %%eax; cpuid; shrl $24, %%ebx;": "=b"(bspid) : :);
-    return smp_cpu_list[bspid];
-}
-
 void ap_startup(void) {
+    /* point gs at this core's per-cpu data before anything uses it */
+    uint8_t id;
+    asm volatile ("mov $1, %%eax; cpuid; shrl $24, %%ebx;": "=b"(id) : :);
+    write_gs(percpu_offset[id]);
+    write_kernel_gs(0);
+
     idt_reinstall();
     vmm_switch_pm(kernel_pd);
+    tlb_cpu_install();
     gdt_flush();
     tss_install();
     lapic_install();
@@ -0,0 +1,225 @@
+#include <cpuid.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <kernel/arch/x86_64/idt.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/arch/x86_64/tlb.h>
+#include <kernel/arch/x86_64/lapic.h>
+#include <kernel/mmu.h>
+#include <kernel/acpi.h>
+#include <kernel/args.h>
+#include <kernel/printf.h>
+#include <kernel/spinlock.h>
+
+/*
+ * One shootdown is in flight at a time. The sender fills in the request,
+ * sets a bit per target core and waits until every target has flushed
+ * and cleared its bit. Cores spinning for the lock keep answering
+ * requests so two senders can't wait on each other.
+ */
+static struct {
+    uintptr_t *pml4;
+    uintptr_t start, end;
+} tlb_request;
+
+static atomic_flag tlb_lock = ATOMIC_FLAG_INIT;
+static _Atomic uint32_t tlb_pending = 0;
+static uint32_t tlb_online = 0;
+
+static bool tlb_is_kernel(uintptr_t virt) {
+    return virt >= KERNEL_VIRT_BASE;
+}
+
+/* toggling cr4.pge drops every entry, global ones and those of all pcids included */
+static void tlb_flush_all(void) {
+    uint64_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4 ^ (1 << 7)) : "memory");
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static void tlb_flush_local(uintptr_t *pml4, uintptr_t start, uintptr_t end) {
+    struct cpu *core = this_core();
+
+    if (!tlb_is_kernel(start) && core->loaded_pml4 != pml4) {
+        /*
+         * Without pcids a map that isn't loaded has nothing in the tlb.
+         * With them its entries may still be around under its old pcid,
+         * so forget it and let the next switch take a fresh one.
+         */
+        if (core->pcid) {
+            VMM_SPACE(pml4)->pcid_gen[core->id] = 0;
+            atomic_fetch_and(&VMM_SPACE(pml4)->cpus, ~(1u << core->id));
+        }
+        return;
+    }
+
+    /* the kernel half is cached under every pcid */
+    if (tlb_is_kernel(start) && core->pcid) {
+        tlb_flush_all();
+        return;
+    }
+
+    if ((end - start) / PAGE_SIZE > TLB_FLUSH_ALL_PAGES) {
+        uint64_t cr3;
+        __asm__ volatile ("mov %%cr3, %0\n\tmov %0, %%cr3" : "=r"(cr3) : : "memory");
+        return;
+    }
+
+    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE)
+        __asm__ volatile ("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static void tlb_handle_pending(void) {
+    uint32_t bit = 1u << this_core()->id;
+    if (!(atomic_load(&tlb_pending) & bit))
+        return;
+
+    tlb_flush_local(tlb_request.pml4, tlb_request.start, tlb_request.end);
+    atomic_fetch_and(&tlb_pending, ~bit);
+}
+
+static void tlb_ipi_handler(struct registers *r) {
+    (void)r;
+    tlb_handle_pending();
+    lapic_eoi();
+}
+
+/* enable pcids on this core if it has them */
+void tlb_cpu_install(void) {
+    struct cpu *core = this_core();
+    unsigned int eax, ebx, ecx, edx;
+
+    core->pcid = false;
+    core->pcid_next = 1;
+    core->pcid_gen = 1;
+
+    if (args_contains("nopcid") || !__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & CPUID_FEAT_ECX_PCID))
+        return;
+
+    /* cr3 is loaded with pcid 0 at this point, which setting cr4.pcide requires */
+    uint64_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4 | (1 << 17)) : "memory");
+    core->pcid = true;
+}
+
+/*
+ * Load pm into cr3. With pcids every page map gets an id per core,
+ * handed out from a counter. The counter running out starts a new
+ * generation with an empty tlb, which invalidates all ids given out
+ * before. A map switched back to with a valid id keeps its entries.
+ */
+void tlb_switch(uintptr_t *pm) {
+    struct cpu *core = this_core();
+    struct vmm_space *space = VMM_SPACE(pm);
+    uint32_t bit = 1u << core->id;
+    uint64_t cr3 = (uint64_t)PHYSICAL_IDENT(pm);
+
+    /* tlb shootdowns for pm have to reach this core from now on */
+    atomic_fetch_or(&space->cpus, bit);
+
+    if (core->pcid) {
+        if (space->pcid_gen[core->id] == core->pcid_gen) {
+            cr3 |= space->pcid[core->id] | TLB_CR3_NOFLUSH;
+        } else {
+            if (core->pcid_next > TLB_MAX_PCID) {
+                tlb_flush_all();
+                core->pcid_gen++;
+                core->pcid_next = 1;
+            }
+            space->pcid[core->id] = core->pcid_next++;
+            space->pcid_gen[core->id] = core->pcid_gen;
+
+            /* without the no-flush bit whatever the id cached before is dropped */
+            cr3 |= space->pcid[core->id];
+        }
+    }
+
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+
+    /* with pcids the old map stays cached, and stays in the mask until flushed */
+    if (!core->pcid && core->loaded_pml4 && core->loaded_pml4 != pm)
+        atomic_fetch_and(&VMM_SPACE(core->loaded_pml4)->cpus, ~bit);
+    core->loaded_pml4 = pm;
+}
+
+void tlb_install(void) {
+    for (uint32_t i = 0; i < madt_lapics; i++)
+        tlb_online |= 1u << i;
+    irq_register(TLB_VECTOR - 32, tlb_ipi_handler);
+    dprintf("%s:%d: tlb shootdown enabled on %d cores\n", __FILE__, __LINE__, madt_lapics);
+}
+
+/* invalidate [start, end) of a page map on every core that may cache it */
+void tlb_shootdown(uintptr_t *pml4, uintptr_t start, uintptr_t end) {
+    if (start >= end)
+        return;
+
+    uint64_t flags = irq_save();
+    uint32_t self = 1u << this_core()->id;
+
+    tlb_flush_local(pml4, start, end);
+
+    uint32_t targets = tlb_is_kernel(start) ? tlb_online : atomic_load(&VMM_SPACE(pml4)->cpus);
+    targets &= tlb_online & ~self;
+    if (!targets) {
+        irq_restore(flags);
+        return;
+    }
+
+    while (atomic_flag_test_and_set_explicit(&tlb_lock, memory_order_acquire)) {
+        tlb_handle_pending();
+        __builtin_ia32_pause();
+    }
+
+    tlb_request.pml4 = pml4;
+    tlb_request.start = start;
+    tlb_request.end = end;
+    atomic_store(&tlb_pending, targets);
+
+    for (uint32_t i = 0; i < SMP_MAX_CORES; i++) {
+        if (targets & (1u << i))
+            lapic_ipi(get_core(i)->lapic_id, TLB_VECTOR);
+    }
+
+    while (atomic_load(&tlb_pending))
+        __builtin_ia32_pause();
+
+    atomic_flag_clear_explicit(&tlb_lock, memory_order_release);
+    irq_restore(flags);
+}
+
+void tlb_batch_init(struct tlb_batch *batch, uintptr_t *pml4) {
+    batch->pml4 = pml4;
+    batch->start = UINTPTR_MAX;
+    batch->end = 0;
+    batch->free_count = 0;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t virt, size_t size) {
+    if (virt < batch->start)
+        batch->start = virt;
+    if (virt + size > batch->end)
+        batch->end = virt + size;
+}
+
+/* free frames once no tlb can reach them anymore */
+void tlb_batch_free(struct tlb_batch *batch, void *phys, size_t pages) {
+    if (batch->free_count == TLB_BATCH_FREE)
+        tlb_batch_flush(batch);
+
+    batch->free[batch->free_count].phys = phys;
+    batch->free[batch->free_count].pages = pages;
+    batch->free_count++;
+}
+
+void tlb_batch_flush(struct tlb_batch *batch) {
+    tlb_shootdown(batch->pml4, batch->start, batch->end);
+
+    for (size_t i = 0; i < batch->free_count; i++)
+        mmu_free(batch->free[i].phys, batch->free[i].pages);
+
+    tlb_batch_init(batch, batch->pml4);
+}
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 
 int tsc_install(void) {
     return 0;
@@ -6,4 +7,10 @@ int tsc_install(void) {
 
 void tsc_sleep(size_t us) {
     
-}
\ No newline at end of file
+}
+
+uint64_t tsc_read(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
@@ -1,7 +1,11 @@
 #include <kernel/arch/x86_64/user.h>
+#include <kernel/arch/x86_64/percpu.h>
 
 extern void syscall_entry(void);
 
+/* user stack pointer while syscall_entry switches stacks */
+DEFINE_PER_CPU(uint64_t, syscall_rsp);
+
 uint64_t rdmsr(uint32_t msr) {
     uint32_t low, high;
     asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
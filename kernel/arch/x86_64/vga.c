@@ -16,7 +16,7 @@ uint16_t *vga_buffer = (uint16_t *)0xB8000;
 int vga_ansi_index = 0;
 char vga_ansi_code[8] = {0};
 
-atomic_flag vga_lock = ATOMIC_FLAG_INIT;
+spinlock_t vga_lock = SPINLOCK_INIT;
 
 uint8_t ansi_to_vga(int ansi) {
     static uint8_t table[] = {
@@ -41,11 +41,11 @@ void vga_clear(void) {
 }
 
 void vga_puts(const char *str) {
-    acquire(&vga_lock);
+    uint64_t flags = spin_lock_irqsave(&vga_lock);
     while (*str) {
         vga_putchar(*str++);
     }
-    release(&vga_lock);
+    spin_unlock_irqrestore(&vga_lock, flags);
 }
 
 void vga_putchar(const char c) {
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stdatomic.h>
 #include <kernel/arch/x86_64/hpet.h>
+#include <kernel/arch/x86_64/tlb.h>
 #include <kernel/arch/x86_64/lapic.h>
 #include <kernel/lfb.h>
 #include <kernel/mmu.h>
@@ -26,10 +27,6 @@ extern char data_end_ld[];
 extern char bss_start_ld[];
 extern char bss_end_ld[];
 
-void vmm_flush_tlb(uintptr_t virt) {
-    __asm__ volatile ("invlpg (%0)" ::"r"(virt) : "memory");
-}
-
 __attribute__((no_sanitize("undefined")))
 void vmm_switch_pm(uintptr_t *pm) {
     if (pm == NULL)
@@ -38,12 +35,17 @@ void vmm_switch_pm(uintptr_t *pm) {
     uint64_t flags;
     __asm__ volatile ("pushfq\n\tpopq %0\n\t" : "=r" (flags) : : "memory");
     __asm__ volatile ("cli" : : : "memory");
-    __asm__ volatile("mov %0, %%cr3" ::"r"((uint64_t)PHYSICAL_IDENT(pm)) : "memory");
+    tlb_switch(pm);
     this_core()->pml4 = pm;
 
     if (flags & (1 << 9)) __asm__ volatile ("sti" : : : "memory");
 }
 
+#define VMM_USER_TOP 0x800000000000
+
+/* address range one entry of a table at level covers, 1 being the pt */
+#define VMM_LEVEL_SHIFT(level) (12 + 9 * ((level) - 1))
+
 uintptr_t *vmm_get_next_lvl(uintptr_t *lvl, uintptr_t entry, uint64_t flags, bool alloc) {
     if (lvl[entry] & PTE_PRESENT) return VIRTUAL_IDENT(PTE_GET_ADDR(lvl[entry]));
     if (!alloc) {
@@ -52,12 +54,119 @@ uintptr_t *vmm_get_next_lvl(uintptr_t *lvl, uintptr_t entry, uint64_t flags, boo
         return NULL;
     }
 
-    uintptr_t *pml = VIRTUAL_IDENT(mmu_alloc(1));
+    void *phys = mmu_alloc(1);
+    uintptr_t *pml = VIRTUAL_IDENT(phys);
     memset(pml, 0, PAGE_SIZE);
-    lvl[entry] = (uintptr_t)PHYSICAL_IDENT(pml) | flags;
+    *mmu_table_count(phys) = 0;
+
+    lvl[entry] = (uintptr_t)phys | flags;
+    (*mmu_table_count(PHYSICAL_IDENT(lvl)))++;
     return pml;
 }
 
+/* replace the 2 MiB page behind pde with a page table mapping the same frames */
+static void vmm_split_huge(uintptr_t *pml4, uintptr_t *pde, uintptr_t virt) {
+    void *table = mmu_alloc(1);
+    uintptr_t *pt = VIRTUAL_IDENT(table);
+    uintptr_t phys = PTE_GET_ADDR(*pde);
+    uint64_t flags = PTE_GET_FLAGS(*pde) & ~PTE_HUGE;
+    for (int i = 0; i < 512; i++)
+        pt[i] = (phys + i * PAGE_SIZE) | flags;
+    *mmu_table_count(table) = 512;
+
+    *pde = (uintptr_t)table | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+    virt = ALIGN_DOWN(virt, HUGE_PAGE_SIZE);
+    tlb_shootdown(pml4, virt, virt + PAGE_SIZE);
+}
+
+/*
+ * Walk down to the page table covering virt. Without alloc missing
+ * tables and huge pages give NULL, with it they are created and split.
+ */
+static uintptr_t *vmm_get_table(uintptr_t *pml4, uintptr_t virt, bool alloc) {
+    uintptr_t *table = pml4;
+    for (int level = 4; level > 1; level--) {
+        uintptr_t *entry = &table[(virt >> VMM_LEVEL_SHIFT(level)) & 0x1ff];
+        if (!(*entry & PTE_PRESENT) && !alloc)
+            return NULL;
+        if (*entry & PTE_HUGE) {
+            if (!alloc || level != 2)
+                return NULL;
+            vmm_split_huge(pml4, entry, virt);
+        }
+        table = vmm_get_next_lvl(table, (virt >> VMM_LEVEL_SHIFT(level)) & 0x1ff, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
+    }
+    return table;
+}
+
+static uintptr_t *vmm_get_pte(uintptr_t *pml4, uintptr_t virt, bool alloc) {
+    uintptr_t *pt = vmm_get_table(pml4, virt, alloc);
+    return pt ? &pt[(virt >> 12) & 0x1ff] : NULL;
+}
+
+/* returns the pd entry covering virt, or NULL if there is no page directory for it yet */
+static uintptr_t *vmm_get_pde(uintptr_t *pml4, uintptr_t virt) {
+    uintptr_t *table = pml4;
+    for (int level = 4; level > 2; level--) {
+        uintptr_t entry = (virt >> VMM_LEVEL_SHIFT(level)) & 0x1ff;
+        if (!(table[entry] & PTE_PRESENT) || (table[entry] & PTE_HUGE))
+            return NULL;
+        table = VIRTUAL_IDENT(PTE_GET_ADDR(table[entry]));
+    }
+    return &table[(virt >> 21) & 0x1ff];
+}
+
+/*
+ * Clear [start, end) in a table at level and everything below it. Each
+ * table is visited once, skipping over entries that aren't present.
+ * User half tables whose present count drops to zero are freed, and
+ * with release so are the frames that were mapped. Frees wait for the
+ * batch to be flushed.
+ */
+static void vmm_unmap_level(uintptr_t *pml4, uintptr_t *table, int level, uintptr_t start, uintptr_t end,
+                            bool release, struct tlb_batch *batch) {
+    uintptr_t size = 1ul << VMM_LEVEL_SHIFT(level);
+    uint32_t *count = mmu_table_count(PHYSICAL_IDENT(table));
+
+    for (uintptr_t addr = start; addr < end;) {
+        uintptr_t next = (addr & ~(size - 1)) + size;
+        if (next > end || next < addr)
+            next = end;
+
+        uintptr_t *entry = &table[(addr >> VMM_LEVEL_SHIFT(level)) & 0x1ff];
+        if (!(*entry & PTE_PRESENT)) {
+            addr = next;
+            continue;
+        }
+
+        /* a huge page that is only partly covered is split first */
+        if (level == 2 && (*entry & PTE_HUGE) && next - addr < size)
+            vmm_split_huge(pml4, entry, addr);
+
+        if (level == 1 || (*entry & PTE_HUGE)) {
+            void *phys = (void *)PTE_GET_ADDR(*entry);
+            *entry = 0;
+            (*count)--;
+            tlb_batch_add(batch, addr, next - addr);
+            if (release)
+                tlb_batch_free(batch, phys, level == 1 ? 1 : 512);
+        } else {
+            uintptr_t *child = VIRTUAL_IDENT(PTE_GET_ADDR(*entry));
+            vmm_unmap_level(pml4, child, level - 1, addr, next, release, batch);
+
+            /* kernel half tables are shared by every page map and stay */
+            if (addr < VMM_USER_TOP && *mmu_table_count(PHYSICAL_IDENT(child)) == 0) {
+                *entry = 0;
+                (*count)--;
+                tlb_batch_add(batch, addr, next - addr);
+                tlb_batch_free(batch, PHYSICAL_IDENT(child), 1);
+            }
+        }
+
+        addr = next;
+    }
+}
+
 void mmu_map_huge(uintptr_t virt, uintptr_t phys, uint64_t flags) {
     uintptr_t pml4_index = (virt >> 39) & 0x1ff;
     uintptr_t pdpt_index = (virt >> 30) & 0x1ff;
@@ -66,144 +175,199 @@ void mmu_map_huge(uintptr_t virt, uintptr_t phys, uint64_t flags) {
     uintptr_t *pdpt = vmm_get_next_lvl(this_core()->pml4, pml4_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
     uintptr_t *pd = vmm_get_next_lvl(pdpt, pdpt_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
  
-    pd[pd_index] = phys | flags | (1 << 7);
+    if (!(pd[pd_index] & PTE_PRESENT))
+        (*mmu_table_count(PHYSICAL_IDENT(pd)))++;
+    pd[pd_index] = phys | flags | PTE_HUGE;
 }
 
-void mmu_unmap_huge(uintptr_t virt) {
-    uintptr_t pml4_index = (virt >> 39) & 0x1ff;
-    uintptr_t pdpt_index = (virt >> 30) & 0x1ff;
-    uintptr_t pd_index   = (virt >> 21) & 0x1ff;
-
-    uintptr_t *pml4 = this_core()->pml4, *pdpt, *pd;
-    if ((pdpt = vmm_get_next_lvl(pml4, pml4_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, false)) == NULL) return;
-    if ((pd = vmm_get_next_lvl(pdpt, pdpt_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, false)) == NULL) return;
-
-    /* check if the page directory entry is present */
-    if (pd[pd_index] & PTE_PRESENT) {
-        /* clear the page directory entry */
-        pd[pd_index] = 0;
-
-        /* check if the page directory is empty */
-        bool pd_empty = true;
-        for (int i = 0; i < 512; i++) {
-            if (pd[i] & PTE_PRESENT) {
-                pd_empty = false;
-                break;
-            }
-        }
-
-        /* free it if it's empty */
-        if (pd_empty) {
-            mmu_free(pd, 1);
-            pdpt[pdpt_index] = 0;
-        }
-    }
-
-    /* check if the page directory pointer table entry is present */
-    bool pdpt_empty = true;
-    for (int i = 0; i < 512; i++) {
-        if (pdpt[i] & PTE_PRESENT) {
-            pdpt_empty = false;
-            break;
+/* map a physically contiguous range, filling each page table in one go */
+__attribute__((no_sanitize("undefined")))
+void mmu_map_pages(size_t count, void *virt, void *phys, uint64_t flags) {
+    uintptr_t addr = (uintptr_t)virt;
+    uintptr_t end = addr + count * PAGE_SIZE;
+    uintptr_t frame = (uintptr_t)phys;
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, this_core()->pml4);
+
+    while (addr < end) {
+        uintptr_t *pt = vmm_get_table(this_core()->pml4, addr, true);
+        uint32_t *used = mmu_table_count(PHYSICAL_IDENT(pt));
+
+        for (size_t i = (addr >> 12) & 0x1ff; i < 512 && addr < end; i++) {
+            /* pages that weren't present can't be in any tlb */
+            if (pt[i] & PTE_PRESENT)
+                tlb_batch_add(&batch, addr, PAGE_SIZE);
+            else
+                (*used)++;
+
+            pt[i] = frame | flags;
+            addr += PAGE_SIZE;
+            frame += PAGE_SIZE;
         }
     }
 
-    /* free it if it's empty */
-    if (pdpt_empty) {
-        mmu_free(pdpt, 1);
-        pml4[pml4_index] = 0;
-    }
-
-    vmm_flush_tlb(virt);
+    tlb_batch_flush(&batch);
 }
 
-__attribute__((no_sanitize("undefined")))
 void mmu_map(void *virt, void *phys, uint64_t flags) {
-    uintptr_t pml4_index = ((uintptr_t)virt >> 39) & 0x1ff;
-    uintptr_t pdpt_index = ((uintptr_t)virt >> 30) & 0x1ff;
-    uintptr_t pd_index = ((uintptr_t)virt >> 21) & 0x1ff;
-    uintptr_t pt_index = ((uintptr_t)virt >> 12) & 0x1ff;
-    
-    uintptr_t *pdpt = vmm_get_next_lvl(this_core()->pml4, pml4_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
-    uintptr_t *pd = vmm_get_next_lvl(pdpt, pdpt_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
-    uintptr_t *pt = vmm_get_next_lvl(pd, pd_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
+    mmu_map_pages(1, virt, phys, flags);
+}
 
-    pt[pt_index] = (uintptr_t)phys | flags; /* map the page */
-    
-    vmm_flush_tlb((uintptr_t)virt); /* flush the tlb entry */
+void mmu_unmap_pages(size_t count, void *virt) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, this_core()->pml4);
+    vmm_unmap_level(this_core()->pml4, this_core()->pml4, 4, (uintptr_t)virt, (uintptr_t)virt + count * PAGE_SIZE, false, &batch);
+    tlb_batch_flush(&batch);
 }
 
 void mmu_unmap(void *virt) {
-    uintptr_t pml4_index = ((uintptr_t)virt >> 39) & 0x1ff;
-    uintptr_t pdpt_index = ((uintptr_t)virt >> 30) & 0x1ff;
-    uintptr_t pd_index   = ((uintptr_t)virt >> 21) & 0x1ff;
-    uintptr_t pt_index   = ((uintptr_t)virt >> 12) & 0x1ff;
-
-    uintptr_t *pml4 = this_core()->pml4, *pdpt, *pd, *pt;
-    if ((pdpt = vmm_get_next_lvl(pml4, pml4_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, false)) == NULL) return;
-    if ((pd = vmm_get_next_lvl(pdpt, pdpt_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, false)) == NULL) return;
-    if ((pt = vmm_get_next_lvl(pd, pd_index, PTE_PRESENT | PTE_WRITABLE | PTE_USER, false)) == NULL) return;
-
-    pt[pt_index] = 0;
-
-    /* check if the page table entry is present */
-    bool pt_empty = true;
-    for (int i = 0; i < 512; i++) {
-        if (pt[i] & PTE_PRESENT) {
-            pt_empty = false;
-            break;
-        }
-    }
+    mmu_unmap_pages(1, virt);
+}
 
-    /* free it if it's empty */
-    if (pt_empty) {
-        mmu_free(PHYSICAL_IDENT(pt), 1);
-        pd[pd_index] = 0;
-    }
+/*
+ * Back the 2 MiB region around virt with one zeroed huge page. Fails if
+ * part of the region is already mapped with small pages or no aligned
+ * block of frames is free, the caller then falls back to a 4 KiB page.
+ */
+bool mmu_fault_huge(uintptr_t virt, uint64_t flags) {
+    uintptr_t base = ALIGN_DOWN(virt, HUGE_PAGE_SIZE);
+    uintptr_t *pdpt = vmm_get_next_lvl(this_core()->pml4, (base >> 39) & 0x1ff, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
+    uintptr_t *pd = vmm_get_next_lvl(pdpt, (base >> 30) & 0x1ff, PTE_PRESENT | PTE_WRITABLE | PTE_USER, true);
+    uintptr_t *pde = &pd[(base >> 21) & 0x1ff];
+    if (*pde & PTE_PRESENT)
+        return false;
+
+    /* the buddy allocator hands out 512 page blocks 2 MiB aligned */
+    void *phys = mmu_try_alloc(512);
+    if (!phys)
+        return false;
+    memset(VIRTUAL_IDENT(phys), 0, HUGE_PAGE_SIZE);
+
+    *pde = (uintptr_t)phys | flags | PTE_HUGE;
+    (*mmu_table_count(PHYSICAL_IDENT(pd)))++;
+    return true;
+}
 
-    /* check if the page directory entry is present */
-    bool pd_empty = true;
-    for (int i = 0; i < 512; i++) {
-        if (pd[i] & PTE_PRESENT) {
-            pd_empty = false;
-            break;
+/* free the pages backing a user range and unmap it */
+void mmu_release_pages(size_t count, void *virt) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, this_core()->pml4);
+    vmm_unmap_level(this_core()->pml4, this_core()->pml4, 4, (uintptr_t)virt, (uintptr_t)virt + count * PAGE_SIZE, true, &batch);
+    tlb_batch_flush(&batch);
+}
+
+/* change the flags of the present pages in a range, shared pages stay copy-on-write */
+void mmu_protect_pages(size_t count, void *virt, uint64_t flags) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, this_core()->pml4);
+
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t addr = (uintptr_t)virt + i * PAGE_SIZE;
+        uintptr_t *pde = vmm_get_pde(this_core()->pml4, addr);
+        if (pde && (*pde & PTE_PRESENT) && (*pde & PTE_HUGE)) {
+            /* huge pages are never shared, a fully covered one keeps its size */
+            if (!(addr & (HUGE_PAGE_SIZE - 1)) && i + 512 <= count) {
+                uint64_t huge_flags = (flags & PTE_PRESENT) ? flags : PTE_PRESENT;
+                *pde = PTE_GET_ADDR(*pde) | huge_flags | PTE_HUGE;
+                tlb_batch_add(&batch, addr, HUGE_PAGE_SIZE);
+                i += 511;
+                continue;
+            }
+            vmm_split_huge(this_core()->pml4, pde, addr);
         }
-    }
 
-    /* free it if it's empty */
-    if (pd_empty) {
-        mmu_free(PHYSICAL_IDENT(pd), 1);
-        pdpt[pdpt_index] = 0;
-    }
+        uintptr_t *pte = vmm_get_pte(this_core()->pml4, addr, false);
+        if (!pte || !(*pte & PTE_PRESENT))
+            continue;
 
-    /* check if the page directory pointer table entry is present */
-    bool pdpt_empty = true;
-    for (int i = 0; i < 512; i++) {
-        if (pdpt[i] & PTE_PRESENT) {
-            pdpt_empty = false;
-            break;
+        uintptr_t phys = PTE_GET_ADDR(*pte);
+        uintptr_t entry = phys | flags;
+        if (!(flags & PTE_PRESENT)) {
+            /* keep the page but take it away from user mode */
+            entry = phys | PTE_PRESENT;
+        } else if ((flags & PTE_WRITABLE) &&
+            ((*pte & PTE_COW) || phys == mmu_zero_page || mmu_page_refs((void *)phys))) {
+            entry = (entry & ~PTE_WRITABLE) | PTE_COW;
         }
-    }
 
-    /* free it if it's empty */
-    if (pdpt_empty) {
-        mmu_free(PHYSICAL_IDENT(pdpt), 1);
-        pml4[pml4_index] = 0;
+        *pte = entry;
+        tlb_batch_add(&batch, addr, PAGE_SIZE);
     }
-
-    vmm_flush_tlb((uintptr_t)virt);
+    tlb_batch_flush(&batch);
 }
 
-void mmu_map_pages(size_t count, void *virt, void *phys, uint64_t flags) {
-    for (uint32_t i = 0; i < count * PAGE_SIZE; i += PAGE_SIZE) {
-        mmu_map((void *)((uintptr_t)virt + i), (void *)((uintptr_t)phys + i), flags);
+/*
+ * Map a range of src into dest, sharing the pages. Writable pages
+ * become read-only copy-on-write pages in both page maps.
+ */
+void mmu_share_pages(uintptr_t *dest, uintptr_t *src, size_t count, void *virt) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, src);
+
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t addr = (uintptr_t)virt + i * PAGE_SIZE;
+        /* copy-on-write works on small pages, so huge pages are split */
+        uintptr_t *pde = vmm_get_pde(src, addr);
+        if (pde && (*pde & PTE_PRESENT) && (*pde & PTE_HUGE))
+            vmm_split_huge(src, pde, addr);
+        uintptr_t *pte = vmm_get_pte(src, addr, false);
+        if (!pte || !(*pte & PTE_PRESENT))
+            continue;
+
+        /* overlapping ranges are only shared once */
+        uintptr_t *dest_pte = vmm_get_pte(dest, addr, true);
+        if (!dest_pte || (*dest_pte & PTE_PRESENT))
+            continue;
+
+        if (*pte & PTE_WRITABLE) {
+            *pte = (*pte & ~PTE_WRITABLE) | PTE_COW;
+            tlb_batch_add(&batch, addr, PAGE_SIZE);
+        }
+
+        mmu_page_ref((void *)PTE_GET_ADDR(*pte));
+        *dest_pte = *pte;
+        (*mmu_table_count(PHYSICAL_IDENT(ALIGN_DOWN((uintptr_t)dest_pte, PAGE_SIZE))))++;
     }
+    tlb_batch_flush(&batch);
 }
 
-void mmu_unmap_pages(size_t count, void *virt) {
-    for (uint32_t i = 0; i < count * PAGE_SIZE; i += PAGE_SIZE) {
-        mmu_unmap((void *)((uintptr_t)virt + i));
+/* returns true if the fault was resolved and the access can be retried */
+bool vmm_handle_fault(uintptr_t virt, uint64_t error) {
+    if (virt >= 0x800000000000)
+        return false;
+
+    /* not present, it may belong to a vma that is filled in lazily */
+    if (!(error & 1))
+        return this && this->vma && vma_handle_fault(this->vma, virt, error & 2);
+
+    /* only write faults on present pages can be copy-on-write */
+    if (!(error & 2))
+        return false;
+
+    uint64_t cr3;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
+    uintptr_t *pml4 = VIRTUAL_IDENT(PTE_GET_ADDR(cr3));
+    uintptr_t *pte = vmm_get_pte(pml4, virt, false);
+    if (!pte || !(*pte & PTE_COW))
+        return false;
+
+    void *phys = (void *)PTE_GET_ADDR(*pte);
+    uint64_t flags = (PTE_GET_FLAGS(*pte) & ~PTE_COW) | PTE_WRITABLE;
+    uintptr_t page = ALIGN_DOWN(virt, PAGE_SIZE);
+
+    if ((uintptr_t)phys == mmu_zero_page || mmu_page_refs(phys)) {
+        void *copy = mmu_alloc(1);
+        memcpy(VIRTUAL_IDENT(copy), VIRTUAL_IDENT(phys), PAGE_SIZE);
+        *pte = (uintptr_t)copy | flags;
+        tlb_shootdown(pml4, page, page + PAGE_SIZE);
+        mmu_free(phys, 1);
+    } else {
+        /* every other owner already took its own copy */
+        *pte = (uintptr_t)phys | flags;
+        tlb_shootdown(pml4, page, page + PAGE_SIZE);
     }
+
+    return true;
 }
 
 uintptr_t mmu_get_physical(uintptr_t *pml4, uintptr_t virt) {
@@ -230,16 +394,16 @@ void mmu_free_page_table(uintptr_t *table, int level) {
 
         uintptr_t entry = table[i];
 
-        if (level == 2 && (entry & (1 << 7))) {
+        if (level == 2 && (entry & PTE_HUGE)) {
             /* 2 MiB huge page */
             table[i] = 0;
             continue;
         }
 
-        uintptr_t *next = (uintptr_t *)PTE_GET_ADDR(entry);
+        uintptr_t *next = VIRTUAL_IDENT(PTE_GET_ADDR(entry));
         if (level > 1) {
             mmu_free_page_table(next, level - 1);
-            mmu_free(next, 1);
+            mmu_free(PHYSICAL_IDENT(next), 1);
         }
 
         table[i] = 0;
@@ -247,8 +411,8 @@ void mmu_free_page_table(uintptr_t *table, int level) {
 }
 
 uintptr_t *mmu_create_user_pm(struct task *proc) {
-    uintptr_t *pml4 = (uintptr_t *)VIRTUAL_IDENT(mmu_alloc(1));
-    memset(pml4, 0, PAGE_SIZE);
+    uintptr_t *pml4 = (uintptr_t *)VIRTUAL_IDENT(mmu_alloc(2));
+    memset(pml4, 0, PAGE_SIZE * 2);
     
     this_core()->pml4 = pml4;
     for (int i = 256; i < 512; i++) {
@@ -262,7 +426,7 @@ uintptr_t *mmu_create_user_pm(struct task *proc) {
 
 void mmu_destroy_user_pm(uintptr_t *pml4) {
     mmu_free_page_table(pml4, 4);
-    mmu_free(PHYSICAL_IDENT(pml4), 1);
+    mmu_free(PHYSICAL_IDENT(pml4), 2);
 }
 
 void vmm_direct_map_huge(uintptr_t *pml4, uintptr_t virt, uintptr_t phys, uint64_t flags) {
@@ -291,13 +455,19 @@ void vmm_direct_map_huge(uintptr_t *pml4, uintptr_t virt, uintptr_t phys, uint64
 void vmm_install(void) {
     for (uintptr_t addr = 0x0; addr < 0x10000000 /* 256MiB */; addr += 0x200000)
         vmm_direct_map_huge(kernel_pd, (uintptr_t)VIRTUAL_IDENT(addr), addr, PTE_PRESENT | PTE_WRITABLE);
+    pmm_remap();
+
+    mmu_zero_page = (uintptr_t)mmu_alloc(1);
+    memset(VIRTUAL_IDENT(mmu_zero_page), 0, PAGE_SIZE);
 
-    kernel_pd = (uintptr_t *)VIRTUAL_IDENT(mmu_alloc(1));
+    kernel_pd = (uintptr_t *)VIRTUAL_IDENT(mmu_alloc(2));
     this_core()->pml4 = kernel_pd;
     memcpy(kernel_pd, initial_pml[0], PAGE_SIZE);
+    memset(VMM_SPACE(kernel_pd), 0, PAGE_SIZE);
 
     dprintf("%s:%d: done mapping kernel regions\n", __FILE__, __LINE__);
 
     vmm_switch_pm(kernel_pd);
     dprintf("%s:%d: successfully switched page tables\n", __FILE__, __LINE__);
+    tlb_cpu_install();
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include <stdbool.h>
 #include <kernel/mmu.h>
 #include <kernel/vma.h>
+#include <kernel/wait.h>
+#include <kernel/kmem.h>
 #include <kernel/elf64.h>
 #include <kernel/printf.h>
 #include <kernel/string.h>
@@ -133,7 +135,14 @@ int elf_module(struct multiboot_tag_module *mod) {
     return metadata->init();
 }
 
-static void elf_load_sections(struct task *proc, Elf64_Ehdr *ehdr, Elf64_Phdr *phdr) {
+static Elf64_Phdr *elf_read_phdrs(struct vfs_node *file, Elf64_Ehdr *ehdr) {
+    size_t size = ehdr->e_phnum * ehdr->e_phentsize;
+    Elf64_Phdr *phdr = (Elf64_Phdr *)kmalloc(size);
+    vfs_read(file, phdr, ehdr->e_phoff, size);
+    return phdr;
+}
+
+static void elf_load_sections(struct task *proc, struct vfs_node *file, Elf64_Ehdr *ehdr, Elf64_Phdr *phdr) {
     //dprintf("%s:%d: mapping sections\n", __FILE__, __LINE__);
     
     int i, section = 0;
@@ -146,27 +155,13 @@ static void elf_load_sections(struct task *proc, Elf64_Ehdr *ehdr, Elf64_Phdr *p
             uint64_t flags = PTE_PRESENT | PTE_USER;
             if (phdr[i].p_flags & PF_W) flags |= PTE_WRITABLE;
 
-            for (size_t page = 0; page < pages; page++) {
-                void *paddr = mmu_alloc(1);
-                void *vaddr = (void *)(page_start + page * PAGE_SIZE);
-
-                mmu_map(vaddr, paddr, flags);
-            }
+            /* nothing is read yet, the page fault handler pulls pages in on first touch */
+            uintptr_t skip = phdr[i].p_vaddr - page_start;
+            vma_map_file(proc->vma, pages, page_start, flags, file, phdr[i].p_offset - skip, phdr[i].p_filesz + skip);
 
             proc->sections[section].ptr = page_start;
             proc->sections[section].length = pages * PAGE_SIZE;
             section++;
-
-            if (phdr[i].p_filesz > 0) {
-                uintptr_t src = (uintptr_t)(uintptr_t)ehdr + phdr[i].p_offset;
-                uintptr_t dest = phdr[i].p_vaddr;
-
-                memcpy((void *)dest, (void *)src, phdr[i].p_filesz);
-            }
-
-            if (phdr[i].p_memsz > phdr[i].p_filesz) {
-                memset((void *)(phdr[i].p_vaddr + phdr[i].p_filesz), 0, phdr[i].p_memsz - phdr[i].p_filesz);
-            }
         }
     }
 }
@@ -178,35 +173,28 @@ int spawn(const char *file, int argc, char *argv[], char *env[]) {
         return -1;
     }
 
-    void *buffer = kmalloc(fptr->size);
-    vfs_read(fptr, buffer, 0, fptr->size);
-    
-    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)buffer;
-
-    if (memcmp(ehdr->e_ident, "\x7f""ELF", 4)) {
+    Elf64_Ehdr ehdr;
+    if (vfs_read(fptr, &ehdr, 0, sizeof ehdr) != (long)sizeof ehdr ||
+        memcmp(ehdr.e_ident, "\x7f""ELF", 4)) {
         printf("%s:%d: invalid elf file\n", __FILE__, __LINE__);
-        kfree(buffer);
         return -1;
     }
 
-    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+    if (ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
         printf("%s:%d: unsupported elf class\n", __FILE__, __LINE__);
-        kfree(buffer);
         return -1;
     }
 
-    struct task *proc = sched_new_user_task((void *)ehdr->e_entry, file, argc, argv, env);
+    struct task *proc = sched_new_user_task((void *)ehdr.e_entry, file, argc, argv, env);
+    Elf64_Phdr *phdr = elf_read_phdrs(fptr, &ehdr);
 
     sched_lock();
     vmm_switch_pm(proc->pml4);
-    
-    Elf64_Phdr *phdr = (Elf64_Phdr *)((uintptr_t)buffer + ehdr->e_phoff);
-    elf_load_sections(proc, ehdr, phdr);
-
+    elf_load_sections(proc, fptr, &ehdr, phdr);
     vmm_switch_pm(kernel_pd);
     sched_unlock();
     
-    kfree(buffer);
+    kfree(phdr);
     sched_add_task(proc, NULL);
     sched_yield();
     return 0;
@@ -219,14 +207,9 @@ int exec(const char *file, int argc, char *const argv[], char *const env[]) {
         return -1;
     }
 
-    void *buffer = kmalloc(fptr->size);
-    vfs_read(fptr, buffer, 0, fptr->size);
-    
-    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)buffer;
-
-    if (memcmp(ehdr->e_ident, "\x7f""ELF", 4)) {
-        kfree(buffer);
-
+    Elf64_Ehdr ehdr;
+    if (vfs_read(fptr, &ehdr, 0, sizeof ehdr) != (long)sizeof ehdr ||
+        memcmp(ehdr.e_ident, "\x7f""ELF", 4)) {
         int new_argc = 0;
         if (argv) for (; argv[new_argc]; new_argc++);
         new_argc++;
@@ -242,20 +225,25 @@ int exec(const char *file, int argc, char *const argv[], char *const env[]) {
         return exec(new_argv[0], new_argc, new_argv, env);
     }
 
-    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+    if (ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
         printf("%s:%d: unsupported elf class\n", __FILE__, __LINE__);
-        kfree(buffer);
         return -1;
     }
 
+    Elf64_Phdr *phdr = elf_read_phdrs(fptr, &ehdr);
+
     sched_lock();
     kfree(this->name);
     this->name = kmalloc(strlen(argv[0]) + 1);
     strcpy(this->name, argv[0]);
-    this->ctx.rip = ehdr->e_entry;
+    this->ctx.rip = ehdr.e_entry;
     this->state = TASK_FRESH;
 
-    uintptr_t stack_top_phys = this->stack_bottom_phys + (USER_STACK_SIZE * PAGE_SIZE);
+    /* the old stack may be shared with the parent, build the new one in private pages */
+    uintptr_t stack_bottom = USER_STACK_TOP - (USER_STACK_SIZE * PAGE_SIZE);
+    uintptr_t stack_bottom_phys = (uintptr_t)mmu_alloc(USER_STACK_SIZE);
+    uintptr_t stack_top_phys = stack_bottom_phys + (USER_STACK_SIZE * PAGE_SIZE);
+    memset(VIRTUAL_IDENT(stack_bottom_phys), 0, (USER_STACK_SIZE * PAGE_SIZE));
     long depth = 16;
 
     int envc = 0;
@@ -302,47 +290,43 @@ int exec(const char *file, int argc, char *const argv[], char *const env[]) {
     *VIRTUAL_IDENT(stack_top_phys - depth) = argc;
     
     this->ctx.rsp = USER_STACK_TOP - depth;
-    memset(VIRTUAL_IDENT(this->stack_bottom_phys), 0, (USER_STACK_SIZE * PAGE_SIZE) - depth);
-    
-    vma_destroy(this->vma);
-    this->vma = vma_create();
 
-    if (this->sections[0].length > 0) {
-        for (int i = 0; this->sections[i].length; i++) {
-            for (size_t j = 0; j < ALIGN_UP(this->sections[i].length, PAGE_SIZE) / PAGE_SIZE; j++) {
-                mmu_free((void *)mmu_get_physical(this->pml4, this->sections[i].ptr + j * PAGE_SIZE), 1);
-            }
-            mmu_unmap_pages(ALIGN_UP(this->sections[i].length, PAGE_SIZE) / PAGE_SIZE, (void *)this->sections[i].ptr);
-            this->sections[i].length = 0;
-        }
+    if (this->vfork_parent) {
+        /* stop borrowing the parent's address space */
+        this->pml4 = mmu_create_user_pm(this);
+        vmm_switch_pm(this->pml4);
+        this->vma = vma_create();
+        sched_vfork_done(this);
+        this->vfork_parent = NULL;
+    } else {
+        /* the old sections are vma blocks too */
+        mmu_release_pages(USER_STACK_SIZE, (void *)stack_bottom);
+        vma_destroy(this->vma);
+        this->vma = vma_create();
     }
+    memset(this->sections, 0, sizeof this->sections);
+
+    mmu_map_pages(USER_STACK_SIZE, (void *)stack_bottom, (void *)stack_bottom_phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
+    this->stack_bottom_phys = stack_bottom_phys;
 
-    Elf64_Phdr *phdr = (Elf64_Phdr *)((uintptr_t)buffer + ehdr->e_phoff);
-    elf_load_sections(this, ehdr, phdr);
+    elf_load_sections(this, fptr, &ehdr, phdr);
 
     sched_unlock();
     
-    kfree(buffer);
+    kfree(phdr);
     sched_yield();
     return -1;
 }
 
-long fork(struct registers *r) {
-    sched_lock();
-
-    struct task *proc = (struct task *)kmalloc(sizeof(struct task));
+static struct task *fork_task(struct registers *r) {
+    struct task *proc = (struct task *)kmem_cache_alloc(task_cache);
     memset(proc, 0, sizeof(struct task));
-    proc->pml4 = mmu_create_user_pm(proc);
-    this_core()->pml4 = proc->pml4;
 
     uintptr_t stack_top = USER_STACK_TOP;
     uintptr_t stack_bottom = stack_top - (USER_STACK_SIZE * PAGE_SIZE);
-    uintptr_t stack_bottom_phys = (uintptr_t)mmu_alloc(USER_STACK_SIZE);
     uint64_t *kernel_stack = VIRTUAL(mmu_alloc(4));
-    mmu_map_pages(USER_STACK_SIZE, (void *)stack_bottom, (void *)stack_bottom_phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
     mmu_map_pages(4, kernel_stack, PHYSICAL(kernel_stack), PTE_PRESENT | PTE_WRITABLE);
 
-    memcpy(VIRTUAL_IDENT(stack_bottom_phys), VIRTUAL_IDENT(this->stack_bottom_phys), (USER_STACK_SIZE * PAGE_SIZE));
     memcpy(kernel_stack, (void *)this->kernel_stack_bottom, (4 * PAGE_SIZE));
     
     proc->parent = this;
@@ -370,12 +354,12 @@ long fork(struct registers *r) {
     memcpy(proc->name, this->name, strlen(this->name) + 1);
     proc->stack = stack_top;
     proc->stack_bottom = (uint64_t)stack_bottom;
-    proc->stack_bottom_phys = (uint64_t)stack_bottom_phys;
+    proc->stack_bottom_phys = this->stack_bottom_phys;
     proc->kernel_stack = (uint64_t)kernel_stack + (4 * PAGE_SIZE);
     proc->kernel_stack_bottom = (uint64_t)kernel_stack;
     proc->state = TASK_RUNNING;
     proc->user = true;
-    proc->gs = this->gs;
+    proc->user_gs = this->user_gs;
     proc->fs = this->fs;
     this->children = proc;
     proc->parent = this;
@@ -384,22 +368,24 @@ long fork(struct registers *r) {
     memcpy(proc->fd_table, this->fd_table, sizeof proc->fd_table);
     memcpy(proc->sections, this->sections, sizeof proc->sections);
     memcpy(proc->signal_handlers, this->signal_handlers, sizeof proc->signal_handlers);
+    proc->policy = this->policy;
+    proc->nice = this->nice;
+    proc->rt_priority = this->rt_priority;
 
-    for (size_t i = 0; i < sizeof this->sections / sizeof(struct task_section); i++) {
-        if (this->sections[i].ptr == 0)
-            break;
-        for (size_t j = 0; j < ALIGN_UP(this->sections[i].length, PAGE_SIZE) / PAGE_SIZE; j++) {
-            void *phys = mmu_alloc(1);
-            //dprintf("phys 0x%lx\n", phys);
-            void *virt = (void *)(this->sections[i].ptr + j * PAGE_SIZE);
-            mmu_map(virt, phys, PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-            memcpy(VIRTUAL_IDENT(phys), virt, PAGE_SIZE);
-        }
-    }
+    return proc;
+}
+
+long fork(struct registers *r) {
+    sched_lock();
+
+    struct task *proc = fork_task(r);
+    proc->pml4 = mmu_create_user_pm(proc);
+
+    /* share everything copy-on-write instead of copying it up front */
+    mmu_share_pages(proc->pml4, this->pml4, USER_STACK_SIZE, (void *)proc->stack_bottom);
 
-    vmm_switch_pm(proc->pml4);
     proc->vma = vma_create();
-    vma_copy_mappings(proc->vma, this->vma);
+    vma_copy_mappings(proc->vma, this->vma, proc->pml4, this->pml4);
     vmm_switch_pm(this->pml4);
 
     // TODO: fix this
@@ -411,4 +397,26 @@ long fork(struct registers *r) {
 
     sched_unlock();
     return proc->pid;
+}
+
+/*
+ * The child runs on the parent's page tables, stack and VMAs until it
+ * calls exec() or exits, and the parent sleeps until then.
+ */
+long vfork(struct registers *r) {
+    sched_lock();
+
+    struct task *proc = fork_task(r);
+    proc->pml4 = this->pml4;
+    proc->vma = this->vma;
+    proc->vfork_parent = this;
+    this->vfork_child = proc;
+
+    sched_add_task(proc, this_core());
+    long pid = proc->pid;
+    sched_unlock();
+
+    /* the child may run on another core and be done before we get here */
+    wait_event(&vfork_wait, !this->vfork_child);
+    return pid;
 }
\ No newline at end of file
@@ -8,7 +8,7 @@ void fifo_init(struct fifo *fifo, int size) {
     fifo->head = 0;
     fifo->tail = 0;
     fifo->count = 0;
-    release(&(fifo->lock));
+    spin_init(&fifo->lock);
 }
 
 int fifo_is_full(struct fifo *fifo) {
@@ -19,24 +19,31 @@ int fifo_is_empty(struct fifo *fifo) {
     return fifo->count == 0;
 }
 
+/* both ends may run in interrupt handlers, so interrupts stay off while locked */
 int fifo_enqueue(struct fifo *fifo, int value) {
-    if (fifo_is_full(fifo)) return false;
+    uint64_t flags = spin_lock_irqsave(&fifo->lock);
+    if (fifo_is_full(fifo)) {
+        spin_unlock_irqrestore(&fifo->lock, flags);
+        return false;
+    }
 
-    acquire(&(fifo->lock));
     fifo->data[fifo->tail] = value;
     fifo->tail = (fifo->tail + 1) % fifo->size;
     fifo->count++;
-    release(&(fifo->lock));
+    spin_unlock_irqrestore(&fifo->lock, flags);
     return true;
 }
 
 int fifo_dequeue(struct fifo *fifo, int *value) {
-    if (fifo_is_empty(fifo)) return false;
+    uint64_t flags = spin_lock_irqsave(&fifo->lock);
+    if (fifo_is_empty(fifo)) {
+        spin_unlock_irqrestore(&fifo->lock, flags);
+        return false;
+    }
 
-    acquire(&(fifo->lock));
     *value = fifo->data[fifo->head];
     fifo->head = (fifo->head + 1) % fifo->size;
     fifo->count--;
-    release(&(fifo->lock));
+    spin_unlock_irqrestore(&fifo->lock, flags);
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/mmu.h>
+#include <kernel/kmem.h>
+#include <kernel/panic.h>
+#include <kernel/malloc.h>
+#include <kernel/printf.h>
+#include <kernel/spinlock.h>
+
+#define KMEM_MAGIC 0x4B4D454D
+
+/*
+ * Typed object caches. Objects are carved from naturally aligned slabs
+ * and run through the constructor once, when their slab is created;
+ * they must be returned to that constructed state before being freed.
+ * The free list link lives in a word after each object so it doesn't
+ * clobber constructed state. Each CPU keeps a short list of free
+ * objects that is refilled from and drained to the slabs in batches.
+ */
+
+#define KMEM_SLAB_OFFSET ALIGN_UP(sizeof(struct kmem_slab), 16)
+#define KMEM_LINK(cache, obj) (*(void **)((uintptr_t)(obj) + (cache)->size))
+
+static void kmem_list_add(struct kmem_slab **list, struct kmem_slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void kmem_list_remove(struct kmem_slab **list, struct kmem_slab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj)) {
+    struct kmem_cache *cache = kmalloc(sizeof(struct kmem_cache));
+    cache->name = name;
+    cache->size = ALIGN_UP(size, 8);
+    cache->slot = ALIGN_UP(cache->size + sizeof(void *), 16);
+    cache->ctor = ctor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    release(&cache->lock);
+
+    /* grow the slab until it holds a reasonable number of objects */
+    cache->slab_pages = 1;
+    while ((cache->slab_pages * PAGE_SIZE - KMEM_SLAB_OFFSET) / cache->slot < 8 && cache->slab_pages < 16)
+        cache->slab_pages *= 2;
+    cache->count = (cache->slab_pages * PAGE_SIZE - KMEM_SLAB_OFFSET) / cache->slot;
+    if (!cache->count)
+        panic("object size %lu too big for cache \"%s\"", size, name);
+
+    for (int i = 0; i < SMP_MAX_CORES; i++) {
+        cache->cpu[i].free = NULL;
+        cache->cpu[i].count = 0;
+    }
+
+    dprintf("%s:%d: created cache \"%s\" (%lu bytes, %u per slab)\n", __FILE__, __LINE__, name, size, cache->count);
+    return cache;
+}
+
+static struct kmem_slab *kmem_new_slab(struct kmem_cache *cache) {
+    struct kmem_slab *slab = (struct kmem_slab *)VIRTUAL_IDENT(mmu_alloc(cache->slab_pages));
+    slab->cache = cache;
+    slab->free = NULL;
+    slab->used = 0;
+    slab->magic = KMEM_MAGIC;
+
+    for (int i = cache->count - 1; i >= 0; i--) {
+        void *obj = (void *)((uintptr_t)slab + KMEM_SLAB_OFFSET + i * cache->slot);
+        if (cache->ctor)
+            cache->ctor(obj);
+        KMEM_LINK(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+    return slab;
+}
+
+static void kmem_refill(struct kmem_cache *cache, struct kmem_cpu *cpu) {
+    acquire(&cache->lock);
+
+    while (cpu->count < KMEM_CPU_BATCH) {
+        struct kmem_slab *slab = cache->partial;
+        if (!slab) {
+            slab = kmem_new_slab(cache);
+            kmem_list_add(&cache->partial, slab);
+        }
+
+        void *obj = slab->free;
+        slab->free = KMEM_LINK(cache, obj);
+        slab->used++;
+        if (!slab->free) {
+            kmem_list_remove(&cache->partial, slab);
+            kmem_list_add(&cache->full, slab);
+        }
+
+        KMEM_LINK(cache, obj) = cpu->free;
+        cpu->free = obj;
+        cpu->count++;
+    }
+
+    release(&cache->lock);
+}
+
+static void kmem_drain(struct kmem_cache *cache, struct kmem_cpu *cpu) {
+    acquire(&cache->lock);
+
+    for (int i = 0; i < KMEM_CPU_BATCH && cpu->free; i++) {
+        void *obj = cpu->free;
+        cpu->free = KMEM_LINK(cache, obj);
+        cpu->count--;
+
+        struct kmem_slab *slab = (struct kmem_slab *)ALIGN_DOWN((uintptr_t)obj, cache->slab_pages * PAGE_SIZE);
+        if (!slab->free) {
+            kmem_list_remove(&cache->full, slab);
+            kmem_list_add(&cache->partial, slab);
+        }
+        KMEM_LINK(cache, obj) = slab->free;
+        slab->free = obj;
+        slab->used--;
+
+        /* keep one empty slab around to avoid thrashing */
+        if (slab->used == 0 && (cache->partial != slab || slab->next)) {
+            kmem_list_remove(&cache->partial, slab);
+            slab->magic = 0;
+            mmu_free(PHYSICAL_IDENT(slab), cache->slab_pages);
+        }
+    }
+
+    release(&cache->lock);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    uint64_t flags = irq_save();
+    struct kmem_cpu *cpu = &cache->cpu[this_core()->id];
+
+    if (!cpu->free)
+        kmem_refill(cache, cpu);
+
+    void *obj = cpu->free;
+    cpu->free = KMEM_LINK(cache, obj);
+    cpu->count--;
+
+    irq_restore(flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    struct kmem_slab *slab = (struct kmem_slab *)ALIGN_DOWN((uintptr_t)obj, cache->slab_pages * PAGE_SIZE);
+    if (slab->magic != KMEM_MAGIC || slab->cache != cache) {
+        printf("%s:%d: bad object 0x%p freed to cache \"%s\"\n", __FILE__, __LINE__, (uint64_t)obj, cache->name);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    struct kmem_cpu *cpu = &cache->cpu[this_core()->id];
+
+    if (cpu->count >= KMEM_CPU_LIMIT)
+        kmem_drain(cache, cpu);
+
+    KMEM_LINK(cache, obj) = cpu->free;
+    cpu->free = obj;
+    cpu->count++;
+
+    irq_restore(flags);
+}
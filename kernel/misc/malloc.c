@@ -2,9 +2,20 @@
 #include <kernel/mmu.h>
 #include <kernel/malloc.h>
 #include <kernel/printf.h>
+#include <kernel/spinlock.h>
 
 #define HEAP_MAGIC 0x58524332
 
+/*
+ * Requests up to HEAP_MAX_SIZE bytes are served from single page slabs
+ * of power-of-two sized objects, bigger ones get their own pages. Both
+ * start with a struct heap_block, so kfree() finds it by rounding the
+ * pointer down to the page. Heap pages are reached through the direct
+ * map and never need to be mapped or unmapped.
+ */
+
+#define HEAP_SLAB_OFFSET ALIGN_UP(sizeof(struct heap_block), 16)
+
 struct heap *kernel_heap;
 
 void *kmalloc(size_t n) {
@@ -19,36 +30,81 @@ void create_kernel_heap(void) {
     kernel_heap = heap_create();
 }
 
+static int heap_class(uint64_t n) {
+    int class = 0;
+    while ((uint64_t)(HEAP_MIN_SIZE << class) < n)
+        class++;
+    return class;
+}
+
+static void heap_list_add(struct heap_block **list, struct heap_block *block) {
+    block->prev = NULL;
+    block->next = *list;
+    if (*list)
+        (*list)->prev = block;
+    *list = block;
+}
+
+static void heap_list_remove(struct heap_block **list, struct heap_block *block) {
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        *list = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+}
+
+static struct heap_block *heap_new_slab(struct heap *h, uint32_t size) {
+    struct heap_block *slab = (struct heap_block *)VIRTUAL_IDENT(mmu_alloc(1));
+    slab->heap = h;
+    slab->size = size;
+    slab->magic = HEAP_MAGIC;
+    slab->free = NULL;
+    slab->used = 0;
+    slab->count = (PAGE_SIZE - HEAP_SLAB_OFFSET) / size;
+
+    /* thread the free list through the objects, lowest address first */
+    for (int i = slab->count - 1; i >= 0; i--) {
+        void **obj = (void **)((uintptr_t)slab + HEAP_SLAB_OFFSET + i * size);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+    return slab;
+}
+
 __attribute__((no_sanitize("undefined")))
 struct heap *heap_create(void) {
-    struct heap *h = (struct heap *)VIRTUAL(mmu_alloc(1));
-    mmu_map(h, PHYSICAL(h), PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-    h->head = (struct heap_block *)VIRTUAL(mmu_alloc(1));
-    mmu_map(h->head, PHYSICAL(h->head), PTE_PRESENT | PTE_WRITABLE | PTE_USER); // TODO: does this need fixing?
-    h->head->next = h->head;
-    h->head->prev = h->head;
-    h->head->size = 0;
-    h->head->magic = HEAP_MAGIC;
+    struct heap *h = (struct heap *)VIRTUAL_IDENT(mmu_alloc(1));
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        h->slabs[i] = NULL;
+        h->full[i] = NULL;
+    }
+    h->large = NULL;
+    release(&h->lock);
     return h;
 }
 
 __attribute__((no_sanitize("undefined")))
 void heap_delete(struct heap *h) {
-    struct heap_block *current = h->head->next;
-    struct heap_block *next;
+    struct heap_block *current, *next;
+
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        for (current = h->slabs[i]; current; current = next) {
+            next = current->next;
+            mmu_free(PHYSICAL_IDENT(current), 1);
+        }
+        for (current = h->full[i]; current; current = next) {
+            next = current->next;
+            mmu_free(PHYSICAL_IDENT(current), 1);
+        }
+    }
 
-    while (current != h->head) {
+    for (current = h->large; current; current = next) {
         next = current->next;
-        size_t pages = DIV_CEILING(sizeof(struct heap_block) + current->size, PAGE_SIZE);
-        mmu_free(PHYSICAL(current), pages);
-        mmu_unmap_pages(pages, (void *)current);
-        current = next;
+        mmu_free(PHYSICAL_IDENT(current), DIV_CEILING(sizeof(struct heap_block) + current->size, PAGE_SIZE));
     }
 
-    mmu_free(PHYSICAL(h->head), 1);
-    mmu_unmap(h->head);
-    mmu_free(PHYSICAL(h), 1);
-    mmu_unmap(h);
+    mmu_free(PHYSICAL_IDENT(h), 1);
 }
 
 __attribute__((no_sanitize("undefined")))
@@ -57,35 +113,92 @@ void *heap_alloc(struct heap *h, uint64_t n) {
         printf("%s:%d: \033[33mwarning:\033[0m allocating 0 bytes\n", __FILE__, __LINE__);
     }
 
-    uint64_t pages = DIV_CEILING(sizeof(struct heap_block) + n, PAGE_SIZE);
-    
-    struct heap_block *block = (struct heap_block *)VIRTUAL(mmu_alloc(pages));
-    if (!block) {
-        printf("%s:%d: allocation failed\n", __FILE__, __LINE__);
-        return NULL;
+    if (n > HEAP_MAX_SIZE) {
+        uint64_t pages = DIV_CEILING(sizeof(struct heap_block) + n, PAGE_SIZE);
+
+        struct heap_block *block = (struct heap_block *)VIRTUAL_IDENT(mmu_alloc(pages));
+        if (!block) {
+            printf("%s:%d: allocation failed\n", __FILE__, __LINE__);
+            return NULL;
+        }
+        block->heap = h;
+        block->size = n;
+        block->magic = HEAP_MAGIC;
+
+        uint64_t flags = acquire_irqsave(&h->lock);
+        heap_list_add(&h->large, block);
+        release_irqrestore(&h->lock, flags);
+
+        return (void*)block + sizeof(struct heap_block);
+    }
+
+    int class = heap_class(n);
+    uint64_t flags = acquire_irqsave(&h->lock);
+
+    struct heap_block *slab = h->slabs[class];
+    if (!slab) {
+        slab = heap_new_slab(h, HEAP_MIN_SIZE << class);
+        heap_list_add(&h->slabs[class], slab);
     }
-    mmu_map_pages(pages, block, PHYSICAL(block), PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-    block->next = h->head;
-    block->prev = h->head->prev;
-    block->size = n;
-    block->magic = HEAP_MAGIC;
 
-    return (void*)block + sizeof(struct heap_block);
+    void **obj = slab->free;
+    slab->free = *obj;
+    slab->used++;
+
+    if (!slab->free) {
+        heap_list_remove(&h->slabs[class], slab);
+        heap_list_add(&h->full[class], slab);
+    }
+
+    release_irqrestore(&h->lock, flags);
+    return obj;
 }
 
 __attribute__((no_sanitize("undefined")))
 void heap_free(void *ptr) {
-    struct heap_block *block = (struct heap_block *)(ptr - sizeof(struct heap_block));
+    struct heap_block *block = (struct heap_block *)ALIGN_DOWN((uintptr_t)ptr, PAGE_SIZE);
 
     if (block->magic != HEAP_MAGIC) {
         printf("%s:%d: bad block magic at address 0x%x\n", __FILE__, __LINE__, (uint64_t)block);
         return;
     }
 
-    block->prev->next = block->next;
-    block->next->prev = block->prev;
-    uint64_t pages = DIV_CEILING(sizeof(struct heap_block) + block->size, PAGE_SIZE);
+    struct heap *h = block->heap;
+
+    if (block->size > HEAP_MAX_SIZE) {
+        uint64_t flags = acquire_irqsave(&h->lock);
+        heap_list_remove(&h->large, block);
+        release_irqrestore(&h->lock, flags);
+
+        block->magic = 0;
+        mmu_free(PHYSICAL_IDENT(block), DIV_CEILING(sizeof(struct heap_block) + block->size, PAGE_SIZE));
+        return;
+    }
+
+    uintptr_t offset = (uintptr_t)ptr - (uintptr_t)block;
+    if (offset < HEAP_SLAB_OFFSET || (offset - HEAP_SLAB_OFFSET) % block->size) {
+        printf("%s:%d: bad pointer 0x%p in slab at address 0x%x\n", __FILE__, __LINE__, (uint64_t)ptr, (uint64_t)block);
+        return;
+    }
+
+    int class = heap_class(block->size);
+    uint64_t flags = acquire_irqsave(&h->lock);
+
+    if (!block->free) {
+        heap_list_remove(&h->full[class], block);
+        heap_list_add(&h->slabs[class], block);
+    }
 
-    mmu_free(PHYSICAL(block), pages);
-    mmu_unmap_pages(pages, block);
-}
\ No newline at end of file
+    *(void **)ptr = block->free;
+    block->free = ptr;
+    block->used--;
+
+    /* keep one empty slab around per class to avoid thrashing */
+    if (block->used == 0 && (h->slabs[class] != block || block->next)) {
+        heap_list_remove(&h->slabs[class], block);
+        block->magic = 0;
+        mmu_free(PHYSICAL_IDENT(block), 1);
+    }
+
+    release_irqrestore(&h->lock, flags);
+}
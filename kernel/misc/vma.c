@@ -1,25 +1,277 @@
 #include <stdbool.h>
 #include <kernel/mmu.h>
 #include <kernel/vma.h>
+#include <kernel/kmem.h>
 #include <kernel/panic.h>
+#include <kernel/malloc.h>
 #include <kernel/printf.h>
 #include <kernel/string.h>
 
 #define VMA_BASE 0x555555554000
-#define VMA_VIRTUAL(ptr) ((void *)((uintptr_t)(ptr) + (uintptr_t)VMA_BASE))
-#define VMA_PHYSICAL(ptr) ((void *)((uintptr_t)(ptr) - (uintptr_t)VMA_BASE))
+
+static struct kmem_cache *vma_block_cache = NULL;
+
+void vma_install(void) {
+    vma_block_cache = kmem_cache_create("vma_block", sizeof(struct vma_block), NULL);
+}
+
+/*
+ * Blocks are kept in a red-black tree keyed by start address for lookups
+ * and on a list sorted the same way for walking ranges in order. Blocks
+ * never overlap, so the start address alone is enough to find the block
+ * holding an address.
+ */
+
+#define VMA_END(block) ((block)->virt + (block)->size * PAGE_SIZE)
+
+static void vma_rotate_left(struct vma_head *h, struct vma_block *x) {
+    struct vma_block *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        h->root = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+}
+
+static void vma_rotate_right(struct vma_head *h, struct vma_block *x) {
+    struct vma_block *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        h->root = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+    y->right = x;
+    x->parent = y;
+}
+
+static void vma_tree_insert(struct vma_head *h, struct vma_block *block) {
+    struct vma_block **link = &h->root, *parent = NULL, *pred = h->head;
+    while (*link) {
+        parent = *link;
+        if (block->virt < parent->virt) {
+            link = &parent->left;
+        } else {
+            pred = parent;
+            link = &parent->right;
+        }
+    }
+
+    block->parent = parent;
+    block->left = NULL;
+    block->right = NULL;
+    block->red = true;
+    *link = block;
+
+    /* the last node we went right at is the block's predecessor */
+    block->prev = pred;
+    block->next = pred->next;
+    pred->next->prev = block;
+    pred->next = block;
+
+    struct vma_block *z = block;
+    while (z->parent && z->parent->red) {
+        struct vma_block *p = z->parent, *g = p->parent;
+        if (p == g->left) {
+            struct vma_block *u = g->right;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->right) {
+                z = p;
+                vma_rotate_left(h, z);
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            vma_rotate_right(h, g);
+        } else {
+            struct vma_block *u = g->left;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->left) {
+                z = p;
+                vma_rotate_right(h, z);
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            vma_rotate_left(h, g);
+        }
+    }
+    h->root->red = false;
+}
+
+static void vma_transplant(struct vma_head *h, struct vma_block *u, struct vma_block *v) {
+    if (!u->parent)
+        h->root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+    if (v)
+        v->parent = u->parent;
+}
+
+static void vma_tree_erase(struct vma_head *h, struct vma_block *z) {
+    struct vma_block *y = z, *x, *parent;
+    bool y_red = y->red;
+
+    if (!z->left) {
+        x = z->right;
+        parent = z->parent;
+        vma_transplant(h, z, z->right);
+    } else if (!z->right) {
+        x = z->left;
+        parent = z->parent;
+        vma_transplant(h, z, z->left);
+    } else {
+        y = z->right;
+        while (y->left)
+            y = y->left;
+        y_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            parent = y;
+        } else {
+            parent = y->parent;
+            vma_transplant(h, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        vma_transplant(h, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    z->prev->next = z->next;
+    z->next->prev = z->prev;
+
+    if (y_red)
+        return;
+
+    while (x != h->root && (!x || !x->red)) {
+        if (x == parent->left) {
+            struct vma_block *w = parent->right;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                vma_rotate_left(h, parent);
+                w = parent->right;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->right || !w->right->red) {
+                    w->left->red = false;
+                    w->red = true;
+                    vma_rotate_right(h, w);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->right)
+                    w->right->red = false;
+                vma_rotate_left(h, parent);
+                x = h->root;
+            }
+        } else {
+            struct vma_block *w = parent->left;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                vma_rotate_right(h, parent);
+                w = parent->left;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!w->left || !w->left->red) {
+                    w->right->red = false;
+                    w->red = true;
+                    vma_rotate_left(h, w);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->left)
+                    w->left->red = false;
+                vma_rotate_right(h, parent);
+                x = h->root;
+            }
+        }
+    }
+    if (x)
+        x->red = false;
+}
+
+/* the last block starting at or below virt, or NULL */
+static struct vma_block *vma_floor(struct vma_head *h, uintptr_t virt) {
+    struct vma_block *node = h->root, *best = NULL;
+    while (node) {
+        if (virt < node->virt) {
+            node = node->left;
+        } else {
+            best = node;
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+static struct vma_block *vma_find(struct vma_head *h, uintptr_t virt) {
+    struct vma_block *block = vma_floor(h, virt);
+    if (block && virt < VMA_END(block))
+        return block;
+    return NULL;
+}
+
+/* the first block ending above virt, or the list head */
+static struct vma_block *vma_lower_bound(struct vma_head *h, uintptr_t virt) {
+    struct vma_block *block = vma_floor(h, virt);
+    if (!block)
+        return h->head->next;
+    if (virt < VMA_END(block))
+        return block;
+    return block->next;
+}
 
 struct vma_head *vma_create(void) {
-    struct vma_head *h = (struct vma_head *)VIRTUAL(mmu_alloc(1));
-    mmu_map(h, PHYSICAL(h), PTE_PRESENT | PTE_WRITABLE | PTE_USER);
-    h->head = (struct vma_block *)VIRTUAL(mmu_alloc(1));
-    mmu_map(h->head, PHYSICAL(h->head), PTE_PRESENT | PTE_WRITABLE | PTE_USER);
+    struct vma_head *h = (struct vma_head *)kmalloc(sizeof(struct vma_head));
+    h->head = (struct vma_block *)kmem_cache_alloc(vma_block_cache);
     h->head->next = h->head;
     h->head->prev = h->head;
     h->head->size = 0;
     h->head->checksum = 0;
     h->head->phys = 0;
     h->head->virt = 0;
+    h->root = NULL;
+    h->next_virt = VMA_BASE;
     return h;
 }
 
@@ -29,83 +281,238 @@ void vma_destroy(struct vma_head *h) {
 
     while (current != h->head) {
         next = current->next;
-        mmu_unmap_pages(current->size, (void *)current->virt);
-        mmu_free((void *)current->phys, current->size);
-        mmu_unmap(current);
-        mmu_free(PHYSICAL(current), 1);
+        if (current->file)
+            vfs_map_put(current->file);
+        mmu_release_pages(current->size, (void *)current->virt);
+        kmem_cache_free(vma_block_cache, current);
         current = next;
     }
 
-    mmu_free(PHYSICAL(h->head), 1);
-    mmu_unmap(h->head);
-    mmu_free(PHYSICAL(h), 1);
-    mmu_unmap(h);
+    kmem_cache_free(vma_block_cache, h->head);
+    kfree(h);
 }
 
-void *vma_map(struct vma_head *h, uint64_t pages, uint64_t phys, uint64_t virt, uint64_t flags) {
-    struct vma_block *block = (struct vma_block *)VIRTUAL(mmu_alloc(1));
-    mmu_map(block, PHYSICAL(block), PTE_PRESENT | PTE_WRITABLE);
-    block->next = h->head;
-    block->prev = h->head->prev;
-    h->head->prev->next = block;
-    h->head->prev = block;
+static struct vma_block *vma_insert(struct vma_head *h, uint64_t pages, uint64_t phys, uint64_t virt, uint64_t flags) {
+    struct vma_block *block = (struct vma_block *)kmem_cache_alloc(vma_block_cache);
     block->size = pages;
-    if (phys) {
-        block->phys = phys;
-    } else {
-        block->phys = (uintptr_t)mmu_alloc(pages);
+    block->phys = phys;
+    block->virt = virt;
+    block->checksum = block->phys + block->virt;
+    block->flags = flags;
+    block->file = NULL;
+    block->file_offset = 0;
+    block->file_size = 0;
+    vma_tree_insert(h, block);
+    return block;
+}
+
+static bool vma_can_merge(struct vma_block *a, struct vma_block *b) {
+    return VMA_END(a) == b->virt && a->flags == b->flags &&
+        !a->phys && !b->phys && !a->file && !b->file;
+}
+
+/* fold lazy anonymous neighbours with the same flags into one block */
+static struct vma_block *vma_merge(struct vma_head *h, struct vma_block *block) {
+    struct vma_block *next = block->next;
+    if (next != h->head && vma_can_merge(block, next)) {
+        block->size += next->size;
+        vma_tree_erase(h, next);
+        kmem_cache_free(vma_block_cache, next);
     }
+
+    struct vma_block *prev = block->prev;
+    if (prev != h->head && vma_can_merge(prev, block)) {
+        prev->size += block->size;
+        vma_tree_erase(h, block);
+        kmem_cache_free(vma_block_cache, block);
+        block = prev;
+    }
+    return block;
+}
+
+/* split a block at virt, returning the new upper half */
+static struct vma_block *vma_split(struct vma_head *h, struct vma_block *block, uintptr_t virt) {
+    uint64_t delta = virt - block->virt;
+    struct vma_block *upper = vma_insert(h, block->size - delta / PAGE_SIZE,
+        block->phys ? block->phys + delta : 0, virt, block->flags);
+
+    upper->file = block->file;
+    if (upper->file)
+        vfs_map_get(upper->file);
+    upper->file_offset = block->file_offset + delta;
+    upper->file_size = block->file_size > delta ? block->file_size - delta : 0;
+    block->size = delta / PAGE_SIZE;
+    return upper;
+}
+
+/* without phys the block is anonymous memory that is faulted in on first touch */
+void *vma_map(struct vma_head *h, uint64_t pages, uint64_t phys, uint64_t virt, uint64_t flags) {
     if (virt) {
-        block->virt = virt;
+        vma_unmap_range(h, virt, pages);
     } else {
-        block->virt = (uintptr_t)VMA_VIRTUAL(block->phys);
+        /* align big mappings so they can be backed by huge pages */
+        if (pages * PAGE_SIZE >= HUGE_PAGE_SIZE)
+            h->next_virt = ALIGN_UP(h->next_virt, HUGE_PAGE_SIZE);
+        virt = h->next_virt;
+        h->next_virt += pages * PAGE_SIZE;
     }
-    mmu_map_pages(pages, (void *)block->virt, (void *)block->phys, flags);
 
-    block->checksum = block->phys + block->virt;
-    block->flags = flags;
+    struct vma_block *block = vma_insert(h, pages, phys, virt, flags);
+    if (phys)
+        mmu_map_pages(pages, (void *)block->virt, (void *)block->phys, flags);
+    else
+        vma_merge(h, block);
+
+    return (void *)virt;
+}
+
+void *vma_map_file(struct vma_head *h, uint64_t pages, uint64_t virt, uint64_t flags, struct vfs_node *file, uint64_t offset, uint64_t size) {
+    vma_unmap_range(h, virt, pages);
+
+    struct vma_block *block = vma_insert(h, pages, 0, virt, flags);
+    block->file = file;
+    block->file_offset = offset;
+    block->file_size = size;
+    vfs_map_get(file);
 
     return (void *)block->virt;
 }
 
-void vma_copy_mappings(struct vma_head *dest, struct vma_head *src) {
+/* the pages are shared copy-on-write, so phys is only a hint afterwards */
+void vma_copy_mappings(struct vma_head *dest, struct vma_head *src, uintptr_t *dest_pml4, uintptr_t *src_pml4) {
     struct vma_block *current = src->head->next;
+    dest->next_virt = src->next_virt;
 
     while (current != src->head) {
-        void *virt = vma_map(dest, current->size, 0, current->virt, current->flags);
-        memcpy(virt, VIRTUAL_IDENT(current->phys), current->size * PAGE_SIZE);
+        struct vma_block *block = vma_insert(dest, current->size, current->phys, current->virt, current->flags);
+        block->file = current->file;
+        block->file_offset = current->file_offset;
+        block->file_size = current->file_size;
+        if (block->file)
+            vfs_map_get(block->file);
+
+        mmu_share_pages(dest_pml4, src_pml4, current->size, (void *)current->virt);
         current = current->next;
     }
 }
 
-void vma_unmap(struct vma_block *block) {
+void vma_unmap(struct vma_head *h, struct vma_block *block) {
     if (block->phys + block->virt != block->checksum) {
         printf("%s:%d: bad checksum at address 0x%x\n", __FILE__, __LINE__, (uint64_t)block);
         return;
     }
 
-    block->prev->next = block->next;
-    block->next->prev = block->prev;
+    vma_tree_erase(h, block);
 
-    mmu_unmap_pages(block->size, (void *)block->virt);
-    mmu_free((void *)block->phys, block->size);
-    mmu_unmap(block);
-    mmu_free(PHYSICAL(block), 1);
+    if (block->file)
+        vfs_map_put(block->file);
+    mmu_release_pages(block->size, (void *)block->virt);
+    kmem_cache_free(vma_block_cache, block);
 }
 
 bool vma_unmap_addr(struct vma_head *h, void *virt) {
-    uintptr_t target = (uintptr_t)virt;
-    struct vma_block *current = h->head->next;
+    struct vma_block *block = vma_find(h, (uintptr_t)virt);
+    if (!block)
+        return false;
 
-    while (current != h->head) {
-        uintptr_t block_start = current->virt;
-        uintptr_t block_end = current->virt + (current->size * PAGE_SIZE);
-        
-        if (target >= block_start && target < block_end) {
-            vma_unmap(current);
+    vma_unmap(h, block);
+    return true;
+}
+
+/* unmap a page aligned range, splitting the blocks at its edges */
+void vma_unmap_range(struct vma_head *h, uintptr_t virt, uint64_t pages) {
+    uintptr_t end = virt + pages * PAGE_SIZE;
+    struct vma_block *block = vma_lower_bound(h, virt);
+
+    while (block != h->head && block->virt < end) {
+        if (block->virt < virt)
+            block = vma_split(h, block, virt);
+        if (VMA_END(block) > end)
+            vma_split(h, block, end);
+
+        struct vma_block *next = block->next;
+        vma_unmap(h, block);
+        block = next;
+    }
+}
+
+/* change the flags of a page aligned range, false if part of it isn't mapped */
+bool vma_protect(struct vma_head *h, uintptr_t virt, uint64_t pages, uint64_t flags) {
+    uintptr_t end = virt + pages * PAGE_SIZE;
+    struct vma_block *block = vma_lower_bound(h, virt);
+
+    /* check the range is fully covered before touching anything */
+    uintptr_t covered = virt;
+    for (struct vma_block *b = block; b != h->head && b->virt < end; b = b->next) {
+        if (b->virt > covered)
+            return false;
+        covered = VMA_END(b);
+    }
+    if (covered < end)
+        return false;
+
+    while (block != h->head && block->virt < end) {
+        if (block->virt < virt)
+            block = vma_split(h, block, virt);
+        if (VMA_END(block) > end)
+            vma_split(h, block, end);
+
+        block->flags = flags;
+        mmu_protect_pages(block->size, (void *)block->virt, flags);
+        block = vma_merge(h, block)->next;
+    }
+    return true;
+}
+
+/* populate a page of a lazy block, called from the page fault handler */
+bool vma_handle_fault(struct vma_head *h, uintptr_t virt, bool write) {
+    struct vma_block *block = vma_find(h, virt);
+    if (!block || block->phys || !(block->flags & PTE_PRESENT))
+        return false;
+
+    uintptr_t page = ALIGN_DOWN(virt, PAGE_SIZE);
+    uint64_t offset = page - block->virt;
+
+    if (!block->file) {
+        /* writes to a 2 MiB window the block fully covers get a huge page */
+        uintptr_t huge = ALIGN_DOWN(virt, HUGE_PAGE_SIZE);
+        if (write && huge >= block->virt && huge + HUGE_PAGE_SIZE <= VMA_END(block) &&
+            mmu_fault_huge(huge, block->flags))
             return true;
+
+        if (write) {
+            void *phys = mmu_alloc(1);
+            memset(VIRTUAL_IDENT(phys), 0, PAGE_SIZE);
+            mmu_map((void *)page, phys, block->flags);
+        } else {
+            /* reads see the shared zero page until the first write copies it */
+            uint64_t flags = block->flags;
+            if (flags & PTE_WRITABLE)
+                flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+            mmu_map((void *)page, (void *)mmu_zero_page, flags);
         }
-        current = current->next;
+        return true;
     }
-    return false;
+
+    /* whole read-only pages come from the file's shared page cache */
+    if (!(block->flags & PTE_WRITABLE) && offset + PAGE_SIZE <= block->file_size &&
+        block->file_offset % PAGE_SIZE == 0) {
+        uintptr_t cached = vfs_cache_page(block->file, block->file_offset + offset);
+        if (cached) {
+            mmu_map((void *)page, (void *)cached, block->flags);
+            return true;
+        }
+    }
+
+    void *phys = mmu_alloc(1);
+    memset(VIRTUAL_IDENT(phys), 0, PAGE_SIZE);
+    if (offset < block->file_size) {
+        size_t len = block->file_size - offset;
+        if (len > PAGE_SIZE)
+            len = PAGE_SIZE;
+        vfs_read(block->file, VIRTUAL_IDENT(phys), block->file_offset + offset, len);
+    }
+
+    mmu_map((void *)page, phys, block->flags);
+    return true;
 }
\ No newline at end of file
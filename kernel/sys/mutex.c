@@ -2,55 +2,68 @@
 #include <kernel/arch/x86_64/smp.h>
 #include <kernel/sched.h>
 #include <kernel/mutex.h>
-#include <kernel/malloc.h>
 #include <kernel/spinlock.h>
 
 void mutex_init(mutex_t *m) {
     m->locked = 0;
     m->owner = NULL;
-    m->queue = NULL;
+    m->wait_head = NULL;
+    m->wait_tail = NULL;
+}
+
+/*
+ * An owner running on another core will likely let go soon. Read
+ * without the lock and reloaded on every spin, so atomic loads keep the
+ * compiler from hoisting them out of the loop.
+ */
+static bool mutex_owner_running(mutex_t *m) {
+    struct task *owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+    if (!owner)
+        return false;
+    struct cpu *core = __atomic_load_n(&owner->core, __ATOMIC_RELAXED);
+    if (!core || core == this_core())
+        return false;
+    return __atomic_load_n(&core->current_proc, __ATOMIC_RELAXED) == owner;
 }
 
 void mutex_lock(mutex_t *m) {
     if (!this) return;
 
-    for (;;) {
-        acquire(&m->lock);
-
-        if (!m->locked) {
-            m->locked = 1;
-            m->owner = this;
-            release(&m->lock);
-            return;
-        }
+    for (int i = 0; i < MUTEX_SPIN_LIMIT && __atomic_load_n(&m->locked, __ATOMIC_RELAXED) && mutex_owner_running(m); i++) {
+#ifdef __x86_64__
+        __builtin_ia32_pause();
+#endif
+    }
 
-        mutex_list_t *i = m->queue;
-        int already_queued = 0;
-        while (i) {
-            if (i->proc == this) {
-                already_queued = 1;
-                break;
-            }
-            i = i->next;
-        }
+    /* no preemption between marking ourselves blocked and yielding */
+    sched_lock();
+    acquire(&m->lock);
 
-        if (!already_queued) {
-            mutex_list_t *node = kmalloc(sizeof(mutex_list_t));
-            node->proc = this;
-            node->next = NULL;
+    if (!m->locked) {
+        m->locked = 1;
+        m->owner = this;
+        release(&m->lock);
+        sched_unlock();
+        return;
+    }
 
-            if (!m->queue) {
-                m->queue = node;
-            } else {
-                i = m->queue;
-                while (i->next) i = i->next;
-                i->next = node;
-            }
-        }
+    this->mutex_next = NULL;
+    if (m->wait_tail)
+        m->wait_tail->mutex_next = this;
+    else
+        m->wait_head = this;
+    m->wait_tail = this;
 
+    /* mutex_unlock() hands the mutex over, anything else is a spurious wakeup */
+    while (m->owner != this) {
+        this->state = TASK_PAUSED;
         release(&m->lock);
-        sched_block(TASK_PAUSED);
+        sched_yield();
+        acquire(&m->lock);
     }
+
+    release(&m->lock);
+    sched_unlock();
 }
 
 void mutex_unlock(mutex_t *m) {
@@ -61,15 +74,17 @@ void mutex_unlock(mutex_t *m) {
         return;
     }
 
-    m->locked = 0;
-    m->owner = NULL;
-
-    if (m->queue != NULL) {
-        mutex_list_t *first_thread = m->queue;
-        m->queue = first_thread->next;
-        sched_unblock(first_thread->proc); 
-        kfree(first_thread);
+    struct task *next = m->wait_head;
+    if (next) {
+        m->wait_head = next->mutex_next;
+        if (!m->wait_head)
+            m->wait_tail = NULL;
+        m->owner = next; /* stays locked, so nobody can barge in */
+        sched_unblock(next);
+    } else {
+        m->locked = 0;
+        m->owner = NULL;
     }
 
     release(&m->lock);
-}
\ No newline at end of file
+}
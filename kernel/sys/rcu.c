@@ -0,0 +1,81 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <kernel/rcu.h>
+#include <kernel/spinlock.h>
+
+/*
+ * Readers count themselves in one of two slots, picked by the low bit
+ * of rcu_epoch. Moving to the next epoch sends new readers to the other
+ * slot, and once the old slot drains nobody can still hold a pointer
+ * that was unlinked before the move.
+ *
+ * Callbacks queued during an epoch wait in rcu_queued, move to
+ * rcu_waiting when the epoch advances, and run on the following
+ * advance, which only happens after the previous epoch's readers are
+ * all gone.
+ */
+static uint32_t rcu_readers[2];
+static uint32_t rcu_epoch;
+static struct rcu_head *rcu_queued;
+static struct rcu_head *rcu_waiting;
+static bool rcu_pending;
+static spinlock_t rcu_lock = SPINLOCK_INIT;
+
+int rcu_read_lock(void) {
+    for (;;) {
+        int epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_fetch_add(&rcu_readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+        /* counted in the slot we read, unless the epoch moved in between */
+        if ((__atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST) & 1) == (uint32_t)epoch)
+            return epoch;
+        __atomic_fetch_sub(&rcu_readers[epoch], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void rcu_read_unlock(int epoch) {
+    __atomic_fetch_sub(&rcu_readers[epoch], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rcu_pending, __ATOMIC_RELAXED))
+        rcu_poll();
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    head->func = func;
+
+    uint64_t flags = spin_lock_irqsave(&rcu_lock);
+    head->next = rcu_queued;
+    rcu_queued = head;
+    __atomic_store_n(&rcu_pending, true, __ATOMIC_RELAXED);
+    spin_unlock_irqrestore(&rcu_lock, flags);
+
+    rcu_poll();
+}
+
+/* advance the epoch if the previous one has drained, never waits */
+void rcu_poll(void) {
+    uint64_t flags = irq_save();
+    if (!spin_trylock(&rcu_lock)) {
+        irq_restore(flags);
+        return;
+    }
+
+    uint32_t epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rcu_readers[(epoch & 1) ^ 1], __ATOMIC_SEQ_CST)) {
+        spin_unlock_irqrestore(&rcu_lock, flags);
+        return;
+    }
+
+    struct rcu_head *done = rcu_waiting;
+    rcu_waiting = rcu_queued;
+    rcu_queued = NULL;
+    if (rcu_waiting)
+        __atomic_store_n(&rcu_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rcu_pending, rcu_waiting != NULL, __ATOMIC_RELAXED);
+    spin_unlock_irqrestore(&rcu_lock, flags);
+
+    while (done) {
+        struct rcu_head *next = done->next;
+        done->func(done);
+        done = next;
+    }
+}
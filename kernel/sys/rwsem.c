@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <kernel/rwsem.h>
+#include <kernel/sched.h>
+#include <kernel/spinlock.h>
+
+void rwsem_init(rwsem_t *s) {
+    s->readers = 0;
+    s->writers_waiting = 0;
+    wait_queue_init(&s->wait);
+    release(&s->lock);
+}
+
+static bool rwsem_try_read(rwsem_t *s) {
+    uint64_t flags = acquire_irqsave(&s->lock);
+    bool taken = s->readers >= 0 && !s->writers_waiting;
+    if (taken)
+        s->readers++;
+    release_irqrestore(&s->lock, flags);
+    return taken;
+}
+
+static bool rwsem_try_write(rwsem_t *s) {
+    uint64_t flags = acquire_irqsave(&s->lock);
+    bool taken = s->readers == 0;
+    if (taken) {
+        s->readers = -1;
+        s->writers_waiting--;
+    }
+    release_irqrestore(&s->lock, flags);
+    return taken;
+}
+
+void rwsem_read_lock(rwsem_t *s) {
+    /* uncontended fast path, no wait queue when no writer holds or waits for it */
+    if (rwsem_try_read(s))
+        return;
+    wait_event(&s->wait, rwsem_try_read(s));
+}
+
+void rwsem_read_unlock(rwsem_t *s) {
+    uint64_t flags = acquire_irqsave(&s->lock);
+    bool last = --s->readers == 0;
+    release_irqrestore(&s->lock, flags);
+
+    if (last)
+        wake_up(&s->wait);
+}
+
+void rwsem_write_lock(rwsem_t *s) {
+    uint64_t flags = acquire_irqsave(&s->lock);
+    s->writers_waiting++;
+    release_irqrestore(&s->lock, flags);
+
+    if (rwsem_try_write(s))
+        return;
+    wait_event(&s->wait, rwsem_try_write(s));
+}
+
+void rwsem_write_unlock(rwsem_t *s) {
+    uint64_t flags = acquire_irqsave(&s->lock);
+    s->readers = 0;
+    release_irqrestore(&s->lock, flags);
+
+    /* readers and writers race for it again, waiting writers still keep new readers out */
+    wake_up(&s->wait);
+}
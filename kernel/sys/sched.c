@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stddef.h>
 #include <stdatomic.h>
 #include <kernel/arch/x86_64/tss.h>
@@ -10,8 +11,11 @@
 #include <kernel/mmu.h>
 #include <kernel/vma.h>
 #include <kernel/acpi.h>
+#include <kernel/kmem.h>
+#include <kernel/wait.h>
 #include <kernel/sched.h>
 #include <kernel/panic.h>
+#include <kernel/assert.h>
 #include <kernel/malloc.h>
 #include <kernel/signal.h>
 #include <kernel/printf.h>
@@ -20,6 +24,11 @@
 
 static long next_pid = 1, next_cpu = 0;
 
+struct kmem_cache *task_cache = NULL;
+struct wait_queue vfork_wait;
+
+DEFINE_PER_CPU(struct task *, current_task);
+
 static void sigchld(struct task *proc, int exit) {
     proc->child_exit = exit;
     sched_unblock(proc);
@@ -42,31 +51,291 @@ void send_signal(struct task *proc, int signal, int extra) {
     if (signal == SIGCHLD) {
         proc->child_exit = extra;
     }
-    proc->state = TASK_SIGNAL;
+
+    /* the handlers run when the scheduler picks the task next */
+    sched_wake(proc, TASK_SIGNAL);
     
     sched_unlock();
 }
 
-void sched_lock(void) {
-#ifdef __x86_64__
-    lapic_stop_timer();
-#endif
+/*
+ * Every core keeps two queues of tasks that are ready to run: a FIFO of
+ * real-time tasks ordered by priority, and a min-heap of the others
+ * keyed by virtual runtime. Sleepers are in a third heap keyed by
+ * deadline. Blocked tasks are on none of them, so picking the next task
+ * never looks at them. All are protected by the core's sched_lock,
+ * taken with interrupts off since the scheduler runs from the timer
+ * interrupt.
+ *
+ * Virtual runtime is the time a task ran in HPET ticks, scaled down by
+ * its weight. Heavier (lower nice) tasks age slower and get a bigger
+ * share of the core.
+ */
+static const uint32_t sched_nice_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+static uint32_t sched_weight(struct task *proc) {
+    return sched_nice_weight[proc->nice + 20];
 }
 
-void sched_unlock(void) {
+static bool sched_rt(struct task *proc) {
+    return proc->policy == SCHED_POLICY_FIFO || proc->policy == SCHED_POLICY_RR;
+}
+
+static bool fair_before(struct task *a, struct task *b) {
+    return a->time.vruntime < b->time.vruntime;
+}
+
+static bool sleep_before(struct task *a, struct task *b) {
+    return a->time.end < b->time.end;
+}
+
+/* a task is on at most one heap at a time, so they share heap_index */
+static void heap_set(struct task_heap *h, uint32_t i, struct task *proc) {
+    h->tasks[i] = proc;
+    proc->heap_index = i;
+}
+
+static void heap_up(struct task_heap *h, uint32_t i, bool (*before)(struct task *, struct task *)) {
+    struct task *proc = h->tasks[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!before(proc, h->tasks[parent]))
+            break;
+        heap_set(h, i, h->tasks[parent]);
+        i = parent;
+    }
+    heap_set(h, i, proc);
+}
+
+static void heap_down(struct task_heap *h, uint32_t i, bool (*before)(struct task *, struct task *)) {
+    struct task *proc = h->tasks[i];
+    for (;;) {
+        uint32_t child = i * 2 + 1;
+        if (child >= h->count)
+            break;
+        if (child + 1 < h->count && before(h->tasks[child + 1], h->tasks[child]))
+            child++;
+        if (!before(h->tasks[child], proc))
+            break;
+        heap_set(h, i, h->tasks[child]);
+        i = child;
+    }
+    heap_set(h, i, proc);
+}
+
+static void heap_insert(struct task_heap *h, struct task *proc, bool (*before)(struct task *, struct task *)) {
+    if (h->count == h->size) {
+        uint32_t size = h->size ? h->size * 2 : 16;
+        struct task **tasks = kmalloc(size * sizeof(struct task *));
+        if (h->tasks) {
+            memcpy(tasks, h->tasks, h->count * sizeof(struct task *));
+            kfree(h->tasks);
+        }
+        h->tasks = tasks;
+        h->size = size;
+    }
+
+    heap_set(h, h->count++, proc);
+    heap_up(h, proc->heap_index, before);
+}
+
+static void heap_remove(struct task_heap *h, struct task *proc, bool (*before)(struct task *, struct task *)) {
+    if (proc->heap_index < 0 || (uint32_t)proc->heap_index >= h->count || h->tasks[proc->heap_index] != proc)
+        return; /* not on this heap */
+
+    uint32_t i = proc->heap_index;
+    struct task *last = h->tasks[--h->count];
+    if (last != proc) {
+        heap_set(h, i, last);
+        heap_down(h, i, before);
+        heap_up(h, last->heap_index, before);
+    }
+    proc->heap_index = -1;
+}
+
+static void sleep_insert(struct cpu *core, struct task *proc) {
+    heap_insert(&core->sleepers, proc, sleep_before);
+}
+
+static void sleep_remove(struct cpu *core, struct task *proc) {
+    heap_remove(&core->sleepers, proc, sleep_before);
+}
+
+/* real-time tasks queue behind those of the same priority, or ahead of them with head set */
+static void rt_insert(struct cpu *core, struct task *proc, bool head) {
+    struct task *next = core->rt_head;
+    while (next && (next->rt_priority > proc->rt_priority || (!head && next->rt_priority == proc->rt_priority)))
+        next = next->rq_next;
+
+    proc->rq_next = next;
+    proc->rq_prev = next ? next->rq_prev : core->rt_tail;
+    if (proc->rq_prev)
+        proc->rq_prev->rq_next = proc;
+    else
+        core->rt_head = proc;
+    if (next)
+        next->rq_prev = proc;
+    else
+        core->rt_tail = proc;
+}
+
+static void rt_remove(struct cpu *core, struct task *proc) {
+    if (proc->rq_prev)
+        proc->rq_prev->rq_next = proc->rq_next;
+    else
+        core->rt_head = proc->rq_next;
+    if (proc->rq_next)
+        proc->rq_next->rq_prev = proc->rq_prev;
+    else
+        core->rt_tail = proc->rq_prev;
+}
+
+static void rq_enqueue(struct cpu *core, struct task *proc, bool head) {
+    if (proc->queued || proc == core->idle_proc)
+        return;
+
+    if (sched_rt(proc)) {
+        rt_insert(core, proc, head);
+    } else {
+        /* sleepers come back slightly ahead of the pack, but can't bank time */
+        uint64_t credit = hpet_us_to_ticks(SCHED_SLICE_US) / 2;
+        uint64_t floor = core->min_vruntime > credit ? core->min_vruntime - credit : 0;
+        if (proc->time.vruntime < floor)
+            proc->time.vruntime = floor;
+        heap_insert(&core->fair, proc, fair_before);
+    }
+    proc->queued = true;
+    core->nr_running++;
+}
+
+static void rq_push(struct cpu *core, struct task *proc) {
+    rq_enqueue(core, proc, false);
+}
+
+static void rq_remove(struct cpu *core, struct task *proc) {
+    if (!proc->queued)
+        return;
+
+    if (sched_rt(proc))
+        rt_remove(core, proc);
+    else
+        heap_remove(&core->fair, proc, fair_before);
+    proc->queued = false;
+    core->nr_running--;
+}
+
+/* real-time tasks always go first, then the one that ran the least */
+static struct task *rq_pop(struct cpu *core) {
+    struct task *proc = core->rt_head;
+    if (!proc && core->fair.count)
+        proc = core->fair.tasks[0];
+    if (proc)
+        rq_remove(core, proc);
+    return proc;
+}
+
+static bool sched_core_idle(struct cpu *core) {
+    return core->idle_proc && core->current_proc == core->idle_proc;
+}
+
+/*
+ * Microseconds until the next timer interrupt is needed, false if none
+ * is. A core with nothing to run only wakes for its first sleeper, new
+ * work reaches it through sched_kick().
+ */
+static bool sched_timeout(struct cpu *core, uint64_t *us) {
+    uint64_t slice = hpet_us_to_ticks(SCHED_SLICE_US);
+    uint64_t timeout = slice;
+    bool tickless = sched_core_idle(core);
+
+    uint64_t flags = acquire_irqsave(&core->sched_lock);
+    tickless = tickless && !core->nr_running;
+    if (core->sleepers.count) {
+        size_t now = hpet_get_ticks();
+        size_t end = core->sleepers.tasks[0]->time.end;
+        timeout = end > now ? end - now : 0;
+        tickless = false;
+    }
+    release_irqrestore(&core->sched_lock, flags);
+
+    if (tickless)
+        return false;
+    if (timeout > slice)
+        timeout = slice;
+    *us = hpet_ticks_to_us(timeout);
+    return true;
+}
+
+/* acknowledge the interrupt and program the next tick, if any */
+static void sched_arm_timer(struct cpu *core) {
 #ifdef __x86_64__
+    uint64_t us;
     lapic_eoi();
-    lapic_oneshot(0x79, 5);
+    if (sched_timeout(core, &us))
+        lapic_oneshot_us(0x79, us);
+    else
+        lapic_stop_timer();
 #endif
 }
 
-void sched_add_task(struct task *proc, struct cpu *core) {
-    sched_lock();
+/*
+ * sched_lock() keeps the running task on its core until the matching
+ * sched_unlock(). The calls nest and only count, a tick that arrives
+ * meanwhile is remembered and the task is preempted once the count
+ * drops back to zero. A task may still block inside the section, which
+ * is what lets it mark itself blocked and yield without racing the
+ * tick. The count is saved with the task and it comes back with the
+ * section still held.
+ */
+void sched_lock(void) {
+    uint64_t flags = irq_save();
+    this_core()->preempt_count++;
+    irq_restore(flags);
+}
 
-    proc->pid = next_pid++;
-    if (!core) {
-        core = get_core(next_cpu);
+void sched_unlock(void) {
+    uint64_t flags = irq_save();
+    struct cpu *core = this_core();
+    assert(core->preempt_count > 0);
+    bool resched = --core->preempt_count == 0 && core->need_resched;
+    irq_restore(flags);
+
+    /* not from interrupt handlers, the tick retries those */
+    if (resched && (flags & 0x200))
+        asm volatile ("int $0x79\n");
+}
+
+/*
+ * Called after queueing work on a core. An idle core is woken to run
+ * it, a busy one gets an idle core to come and steal it.
+ */
+static void sched_kick(struct cpu *core) {
+    if (sched_core_idle(core)) {
+        lapic_ipi(core->lapic_id, SCHED_WAKE_VECTOR);
+        return;
+    }
+    if (!core->nr_running)
+        return;
+
+    for (uint32_t i = 0; i < madt_lapics; i++) {
+        struct cpu *c = get_core(i);
+        if (c && c != core && sched_core_idle(c)) {
+            lapic_ipi(c->lapic_id, SCHED_WAKE_VECTOR);
+            return;
+        }
     }
+}
+
+static void proc_list_add(struct cpu *core, struct task *proc) {
     if (!core->processes) {
         proc->prev = proc;
         proc->next = proc;
@@ -77,6 +346,157 @@ void sched_add_task(struct task *proc, struct cpu *core) {
         proc->next = core->processes;
         core->processes->prev = proc;
     }
+}
+
+static void proc_list_remove(struct cpu *core, struct task *proc) {
+    if (core->processes == proc)
+        core->processes = proc->next != proc ? proc->next : NULL;
+    proc->prev->next = proc->next;
+    proc->next->prev = proc->prev;
+}
+
+/* lock the core a task is on, it may be migrated while we wait */
+static struct cpu *task_core_lock(struct task *proc, uint64_t *flags) {
+    for (;;) {
+        struct cpu *core = proc->core;
+        *flags = acquire_irqsave(&core->sched_lock);
+        if (proc->core == core)
+            return core;
+        release_irqrestore(&core->sched_lock, *flags);
+    }
+}
+
+/*
+ * Balancing pulls queued tasks from the busiest core to the calling
+ * one, either when the caller has nothing to run or every
+ * SCHED_BALANCE_INTERVAL passes through the scheduler. The running
+ * task and the one the victim just switched away from are left alone,
+ * the victim may still be on the latter's kernel stack until it returns
+ * from the interrupt. Address spaces need no special care, the thief
+ * switches to the task's pml4 like for any other task.
+ */
+static struct cpu *sched_busiest(struct cpu *core) {
+    struct cpu *busiest = NULL;
+    for (uint32_t i = 0; i < madt_lapics; i++) {
+        struct cpu *c = get_core(i);
+        if (!c || c == core || !c->idle_proc)
+            continue;
+        if (!busiest || c->nr_running > busiest->nr_running)
+            busiest = c;
+    }
+    return busiest;
+}
+
+static bool sched_can_migrate(struct cpu *from, struct task *proc) {
+    return proc != from->current_proc && proc != from->last_proc && proc != from->cleaner_proc;
+}
+
+/* the least urgent migratable task, real-time ones first as they can't wait for their core */
+static struct task *sched_steal(struct cpu *from) {
+    for (struct task *proc = from->rt_tail; proc; proc = proc->rq_prev) {
+        if (sched_can_migrate(from, proc))
+            return proc;
+    }
+    for (uint32_t i = from->fair.count; i-- > 0;) {
+        if (sched_can_migrate(from, from->fair.tasks[i]))
+            return from->fair.tasks[i];
+    }
+    return NULL;
+}
+
+static void sched_migrate(struct cpu *from, struct cpu *to, struct task *proc) {
+    rq_remove(from, proc);
+    proc_list_remove(from, proc);
+    proc->core = to;
+    proc_list_add(to, proc);
+
+    /* keep its lead or lag relative to the other tasks */
+    int64_t lag = (int64_t)(proc->time.vruntime - from->min_vruntime);
+    if (lag < 0 && (uint64_t)-lag > to->min_vruntime)
+        proc->time.vruntime = 0;
+    else
+        proc->time.vruntime = to->min_vruntime + lag;
+    rq_push(to, proc);
+    to->nr_migrations++;
+}
+
+/* called with interrupts off and no scheduler locks held */
+static void sched_balance(struct cpu *core) {
+    struct cpu *busiest = sched_busiest(core);
+    if (!busiest || !busiest->nr_running)
+        return;
+
+    /* take both locks in core order so two thieves can't deadlock */
+    struct cpu *first = core->id < busiest->id ? core : busiest;
+    struct cpu *second = first == core ? busiest : core;
+    acquire(&first->sched_lock);
+    acquire(&second->sched_lock);
+
+    for (int moved = 0; moved < SCHED_BALANCE_MAX; moved++) {
+        if (busiest->nr_running <= core->nr_running + 1 && (core->nr_running || !busiest->nr_running))
+            break;
+
+        struct task *proc = sched_steal(busiest);
+        if (!proc)
+            break;
+        sched_migrate(busiest, core, proc);
+    }
+
+    release(&second->sched_lock);
+    release(&first->sched_lock);
+}
+
+/* make a blocked task runnable in the given state, on the core it belongs to */
+void sched_wake(struct task *proc, enum task_state state) {
+    if (!proc->core) {
+        proc->state = state;
+        return;
+    }
+
+    uint64_t flags;
+    struct cpu *core = task_core_lock(proc, &flags);
+    bool woken = proc->state != TASK_KILLED;
+    if (woken) {
+        if (proc->state == TASK_SLEEPING)
+            sleep_remove(core, proc);
+        proc->state = state;
+        /* a task on its cpu is queued again when it switches out */
+        if (proc != core->current_proc)
+            rq_push(core, proc);
+    }
+    release_irqrestore(&core->sched_lock, flags);
+
+    if (woken)
+        sched_kick(core);
+}
+
+void sched_add_task(struct task *proc, struct cpu *core) {
+    sched_lock();
+
+    proc->pid = next_pid++;
+    if (!core) {
+        /* least loaded core, starting the search where the last one was placed */
+        core = get_core(next_cpu);
+        for (uint32_t i = 1; i < madt_lapics; i++) {
+            struct cpu *c = get_core((next_cpu + i) % madt_lapics);
+            if (c && c->nr_running < core->nr_running)
+                core = c;
+        }
+    }
+    proc->core = core;
+    proc->queued = false;
+    proc->rq_next = proc->rq_prev = NULL;
+    proc->heap_index = -1;
+
+    uint64_t flags = acquire_irqsave(&core->sched_lock);
+    proc_list_add(core, proc);
+    if (proc->state == TASK_RUNNING)
+        rq_push(core, proc);
+    release_irqrestore(&core->sched_lock, flags);
+
+    if (proc->state == TASK_RUNNING)
+        sched_kick(core);
+
     next_cpu++;
     if (next_cpu >= madt_lapics)
         next_cpu = 0;
@@ -86,7 +506,7 @@ void sched_add_task(struct task *proc, struct cpu *core) {
 }
 
 struct task *sched_new_task(void *entry, const char *name) {
-    struct task *proc = (struct task *)kmalloc(sizeof(struct task));
+    struct task *proc = (struct task *)kmem_cache_alloc(task_cache);
     memset(proc, 0, sizeof(struct task));
     proc->pml4 = this_core()->pml4;
 
@@ -102,7 +522,6 @@ struct task *sched_new_task(void *entry, const char *name) {
     proc->name = (char *)name;
     proc->stack = (uint64_t)stack + (4 * PAGE_SIZE);
     proc->stack_bottom = (uint64_t)stack;
-    proc->gs = 0;
     proc->fs = 0;
     proc->state = TASK_RUNNING;
     proc->user = false;
@@ -122,7 +541,7 @@ struct task *sched_new_user_task(void *entry, const char *name, int argc, char *
         argv[1] = NULL;
     }
 
-    struct task *proc = (struct task *)kmalloc(sizeof(struct task));
+    struct task *proc = (struct task *)kmem_cache_alloc(task_cache);
     memset(proc, 0, sizeof(struct task));
     proc->pml4 = mmu_create_user_pm(proc);
 
@@ -192,7 +611,6 @@ struct task *sched_new_user_task(void *entry, const char *name, int argc, char *
     proc->stack_bottom_phys = (uint64_t)stack_bottom_phys;
     proc->kernel_stack = (uint64_t)kernel_stack + (4 * PAGE_SIZE);
     proc->kernel_stack_bottom = (uint64_t)kernel_stack;
-    proc->gs = (uint64_t)proc;
     proc->fs = 0;
     proc->state = TASK_RUNNING;
     proc->user = true;
@@ -213,78 +631,133 @@ struct task *sched_new_user_task(void *entry, const char *name, int argc, char *
     return proc;
 }
 
+static void sched_run_signals(struct task *proc) {
+    uint32_t pending = proc->pending_signals;
+    proc->pending_signals = 0;
+    proc->state = TASK_RUNNING;
+
+    for (int sig = 1; sig <= 32; sig++) {
+        uint32_t sig_mask = 1 << (sig - 1);
+
+        if ((pending & sig_mask) && proc->signal_handlers[sig]) {
+            int extra = (sig == SIGCHLD) ? proc->child_exit : 0;
+            proc->signal_handlers[sig](proc, extra);
+        }
+    }
+}
+
 void sched_schedule(struct registers *r) {
-    sched_lock();
+    struct cpu *core = this_core();
+
+    /* a tick inside sched_lock(), switch in sched_unlock() instead */
+    if (core->preempt_count && !(this && this->yielded)) {
+        core->need_resched = true;
+        sched_arm_timer(core);
+        return;
+    }
+    core->need_resched = false;
+    if (this)
+        this->preempt_count = core->preempt_count;
+
+    size_t hpet_ticks = hpet_get_ticks();
 
     if (this) {
         if (this->state != TASK_FRESH) {
             memcpy(&(this->ctx), r, sizeof(struct registers));
-            this->gs = read_kernel_gs();
-            this->user_gs = read_gs();
+            this->user_gs = read_kernel_gs();
             asm volatile ("fxsave %0 " : : "m"(this->fxsave));
         } else this->state = TASK_RUNNING;
-    } else {
-        this = process_list;
+
+        uint64_t ran = hpet_ticks - this->time.start;
+        if (this->state == TASK_RUNNING)
+            this->time.last = ran;
+        if (this != core->idle_proc) {
+            this->time.total += ran;
+            if (!sched_rt(this))
+                this->time.vruntime += ran * sched_nice_weight[20] / sched_weight(this);
+        }
     }
 
-    size_t hpet_ticks = hpet_get_ticks();
-    if (this->state == TASK_RUNNING)
-        this->time.last = hpet_ticks - this->time.start;
+    /* load average in 1/SCHED_LOAD_SCALE tasks, decaying by 1/8 per pass */
+    core->load_avg += ((int32_t)(core->nr_running * SCHED_LOAD_SCALE) - (int32_t)core->load_avg) / 8;
+    core->nr_switches++;
 
-    if (!this->next) {
-        this = process_list;
-    } else {
-        this = this->next;
+    if (++core->balance_ticks >= SCHED_BALANCE_INTERVAL) {
+        core->balance_ticks = 0;
+        sched_balance(core);
     }
 
-    struct task *current = this;
-    do {
-        if (this->state == TASK_SLEEPING &&
-            hpet_ticks >= this->time.end) {
-            this->state = TASK_RUNNING;
-            this->time.last = this->time.end - this->time.start;
-            break;
-        }
-        if (this->state == TASK_SIGNAL) {
-            uint32_t pending = this->pending_signals;
-            this->pending_signals = 0;
-            this->state = TASK_RUNNING;
-            
-            for (int sig = 1; sig <= 32; sig++) {
-                uint32_t sig_mask = 1 << (sig - 1);
-                
-                if ((pending & sig_mask) && this->signal_handlers[sig]) {
-                    int extra = (sig == SIGCHLD) ? this->child_exit : 0;
-                    this->signal_handlers[sig](this, extra);
-                }
-            }
-        }
+    struct task *next = NULL;
+    for (bool balanced = false;;) {
+        acquire(&core->sched_lock);
 
-        if (this->state == TASK_RUNNING && !this->doing_blocking_io) {
-            goto actually_switch;
+        /* the last pick blocked in its signal handlers, queue it if woken since */
+        if (next && next->state == TASK_RUNNING)
+            rq_push(core, next);
+
+        /* a preempted fifo task keeps its place, everyone else queues up again */
+        if (this && (this->state == TASK_RUNNING || this->state == TASK_SIGNAL))
+            rq_enqueue(core, this, this->policy == SCHED_POLICY_FIFO && !this->yielded);
+        if (this)
+            this->yielded = false;
+        core->last_proc = this;
+
+        while (core->sleepers.count && hpet_ticks >= core->sleepers.tasks[0]->time.end) {
+            struct task *proc = core->sleepers.tasks[0];
+            sleep_remove(core, proc);
+            proc->state = TASK_RUNNING;
+            proc->time.last = proc->time.end - proc->time.start;
+            rq_push(core, proc);
         }
 
-        this = this->next;
-    } while (this != current);
+        next = rq_pop(core);
+        /* published before the lock drops, so nobody steals or requeues it while it runs */
+        core->current_proc = next ? next : core->idle_proc;
+
+        /* min_vruntime only moves forward, it is where new and woken tasks start */
+        uint64_t min = next && !sched_rt(next) ? next->time.vruntime : UINT64_MAX;
+        if (core->fair.count && core->fair.tasks[0]->time.vruntime < min)
+            min = core->fair.tasks[0]->time.vruntime;
+        if (min != UINT64_MAX && min > core->min_vruntime)
+            core->min_vruntime = min;
+        release(&core->sched_lock);
 
-    this = this_core()->idle_proc;
+        if (!next && !balanced) {
+            /* about to idle, try to take work from another core first */
+            balanced = true;
+            sched_balance(core);
+            continue;
+        }
+        if (!next) {
+            next = core->idle_proc;
+            break;
+        }
+
+        /* handlers may block or kill the task, then look for another one */
+        if (next->state == TASK_SIGNAL)
+            sched_run_signals(next);
+        if (next->state == TASK_RUNNING)
+            break;
+    }
 
-actually_switch:
+    this_cpu_write(current_task, next);
+    core->preempt_count = next->preempt_count;
     this->time.start = hpet_ticks;
 
     memcpy(r, &(this->ctx), sizeof(struct registers));
     if (this_core()->pml4 != this->pml4)
         vmm_switch_pm(this->pml4);
-    write_kernel_gs((uint64_t)this);
-    write_gs(this->user_gs);
+    write_kernel_gs(this->user_gs);
     set_kernel_stack(this->kernel_stack);
     asm volatile ("fxrstor %0 " : : "m"(this->fxsave));
     wrmsr(IA32_FS_BASE, this->fs);
 
-    sched_unlock();
+    sched_arm_timer(core);
 }
 
 void sched_yield(void) {
+    if (this)
+        this->yielded = true;
     //lapic_ipi(this_core()->lapic_id, 0x79);
     asm volatile ("int $0x79\n");
 }
@@ -295,12 +768,29 @@ void sched_block(enum task_state reason) {
 }
 
 void sched_unblock(struct task *proc) {
-    proc->state = TASK_RUNNING;
+    if (proc->state != TASK_RUNNING)
+        sched_wake(proc, TASK_RUNNING);
 }
 
-void sched_sleep(int us) {
-    this->time.end = hpet_get_ticks() + us * (hpet_period / 1000000);
-    sched_block(TASK_SLEEPING);
+/* hand the address space back to a parent sleeping in vfork() */
+void sched_vfork_done(struct task *proc) {
+    struct task *parent = proc->vfork_parent;
+    if (parent && parent->vfork_child == proc) {
+        parent->vfork_child = NULL;
+        wake_up(&vfork_wait);
+    }
+}
+
+void sched_sleep(size_t us) {
+    struct cpu *core = this->core;
+    this->time.end = hpet_get_ticks() + hpet_us_to_ticks(us);
+
+    uint64_t flags = acquire_irqsave(&core->sched_lock);
+    this->state = TASK_SLEEPING;
+    sleep_insert(core, this);
+    release_irqrestore(&core->sched_lock, flags);
+
+    sched_yield();
 }
 
 void sched_kill(struct task *proc, int status) {
@@ -316,12 +806,21 @@ void sched_kill(struct task *proc, int status) {
     if (proc->parent) {
         send_signal(proc->parent, SIGCHLD, status);
     }
-    
+    sched_vfork_done(proc);
+
+    uint64_t flags;
+    struct cpu *core = task_core_lock(proc, &flags);
+    rq_remove(core, proc);
+    if (proc->state == TASK_SLEEPING)
+        sleep_remove(core, proc);
     proc->state = TASK_KILLED;
-    proc->prev->next = proc->next;
-    proc->next->prev = proc->prev;
+    proc_list_remove(core, proc);
+    release_irqrestore(&core->sched_lock, flags);
+
+    flags = acquire_irqsave(&this_core()->sched_lock);
     proc->next = this_core()->terminated_processes;
     this_core()->terminated_processes = proc;
+    release_irqrestore(&this_core()->sched_lock, flags);
     
     sched_unblock(this_core()->cleaner_proc);
     sched_unlock();
@@ -335,47 +834,44 @@ void sched_kill(struct task *proc, int status) {
 void sched_cleaner(void) {
     for (;;) {
         sched_lock();
-        
+
+        uint64_t flags = acquire_irqsave(&this_core()->sched_lock);
         struct task *proc = this_core()->terminated_processes;
+        if (proc)
+            this_core()->terminated_processes = proc->next;
+        release_irqrestore(&this_core()->sched_lock, flags);
+
         if (!proc) {
             sched_block(TASK_PAUSED);
+            sched_unlock();
             continue;
         }
-        this_core()->terminated_processes = proc->next;
         
         if (proc->user) {
             //printf("Killing %d - %s!\n", proc->pid, proc->name);
             if (proc->parent) {
                 proc->parent->children = NULL;
             }
-            
-            extern atomic_flag flanterm_lock;
-            release(&flanterm_lock);
-
-            this_core()->pml4 = proc->pml4;
-            if (proc->sections[0].length > 0) {
-                for (int i = 0; proc->sections[i].length; i++) {
-                    //mmu_free((void *)mmu_get_physical(proc->pml4, proc->sections[i].ptr), ALIGN_UP(proc->sections[i].length, PAGE_SIZE) / PAGE_SIZE);
-                    for (size_t j = 0; j < ALIGN_UP(proc->sections[i].length, PAGE_SIZE) / PAGE_SIZE; j++) {
-                        mmu_free((void *)mmu_get_physical(proc->pml4, proc->sections[i].ptr + j * PAGE_SIZE), 1);
-                    }
-                    mmu_unmap_pages(ALIGN_UP(proc->sections[i].length, PAGE_SIZE) / PAGE_SIZE, (void *)proc->sections[i].ptr);
-                }
-            }
 
-            mmu_unmap_pages(USER_STACK_SIZE, (void *)proc->stack_bottom);
+            /* a vfork child that never called exec() owns no user memory */
+            bool borrowed = proc->vfork_parent != NULL;
+
+            this_core()->pml4 = borrowed ? kernel_pd : proc->pml4;
+            if (!borrowed)
+                mmu_release_pages(USER_STACK_SIZE, (void *)proc->stack_bottom);
             mmu_unmap_pages(4, (void *)proc->kernel_stack_bottom);
-            mmu_free((void *)proc->stack_bottom_phys, USER_STACK_SIZE);
             mmu_free(PHYSICAL(proc->kernel_stack_bottom), 4);
             kfree(proc->name);
-            vma_destroy(proc->vma);
-            mmu_destroy_user_pm(proc->pml4);
+            if (!borrowed) {
+                vma_destroy(proc->vma);
+                mmu_destroy_user_pm(proc->pml4);
+            }
         } else {
             mmu_unmap_pages(4, (void *)proc->stack_bottom);
             mmu_free(PHYSICAL(proc->stack_bottom), 4);
         }
         
-        kfree(proc);
+        kmem_cache_free(task_cache, proc);
         sched_unlock();
     }
 }
@@ -386,6 +882,76 @@ void sched_idle(void) {
     }
 }
 
+struct task *sched_find_task(long pid) {
+    struct task *found = NULL;
+
+    for (uint32_t i = 0; i < madt_lapics && !found; i++) {
+        struct cpu *core = get_core(i);
+        if (!core)
+            continue;
+
+        uint64_t flags = acquire_irqsave(&core->sched_lock);
+        struct task *current = core->processes;
+        if (current) {
+            do {
+                if (current->pid == pid) {
+                    found = current;
+                    break;
+                }
+                current = current->next;
+            } while (current != core->processes);
+        }
+        release_irqrestore(&core->sched_lock, flags);
+    }
+    return found;
+}
+
+long sched_set_policy(struct task *proc, enum task_policy policy, int rt_priority) {
+    switch (policy) {
+        case SCHED_POLICY_OTHER:
+        case SCHED_POLICY_BATCH:
+            if (rt_priority != 0)
+                return -EINVAL;
+            break;
+        case SCHED_POLICY_FIFO:
+        case SCHED_POLICY_RR:
+            if (rt_priority < 1 || rt_priority > 99)
+                return -EINVAL;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (!proc->core) {
+        proc->policy = policy;
+        proc->rt_priority = rt_priority;
+        return 0;
+    }
+
+    /* requeue it, the task may move between the fifo and the heap */
+    uint64_t flags;
+    struct cpu *core = task_core_lock(proc, &flags);
+    bool queued = proc->queued;
+    rq_remove(core, proc);
+    proc->policy = policy;
+    proc->rt_priority = rt_priority;
+    if (queued)
+        rq_push(core, proc);
+    release_irqrestore(&core->sched_lock, flags);
+    return 0;
+}
+
+long sched_set_nice(struct task *proc, int nice) {
+    if (nice < -20)
+        nice = -20;
+    if (nice > 19)
+        nice = 19;
+
+    /* the weight only applies to runtime still to come, the heap order is unchanged */
+    proc->nice = nice;
+    return 0;
+}
+
 void sched_unblock_all_io(void) {
     sched_lock();
     
@@ -410,6 +976,14 @@ void sched_unblock_all_io(void) {
     sched_unlock();
 }
 
+/* only idle cores reschedule, anyone else may be inside sched_lock() */
+static void sched_wake_ipi(struct registers *r) {
+    if (sched_core_idle(this_core()))
+        sched_schedule(r);
+    else
+        lapic_eoi();
+}
+
 void sched_start_all_cores(void) {
     for (uint32_t i = 0; i < madt_lapics; i++) {
         struct cpu *core = get_core(i);
@@ -427,11 +1001,50 @@ void sched_start_all_cores(void) {
     }
 
     irq_register(0x79 - 32, sched_schedule);
+    irq_register(SCHED_WAKE_VECTOR - 32, sched_wake_ipi);
     for (uint32_t i = madt_lapics - 1; i >= 0; i--) {
         lapic_ipi(i, 0x79);
     }
 }
 
+/* per core load statistics, one line per core */
+long schedstat_read(struct vfs_node *node, void *buffer, long offset, size_t len) {
+    if (offset < 0)
+        return -EINVAL;
+
+    char *text = kmalloc(madt_lapics * 128 + 1);
+    size_t used = 0;
+    text[0] = '\0';
+
+    for (uint32_t i = 0; i < madt_lapics; i++) {
+        struct cpu *core = get_core(i);
+        if (!core)
+            continue;
+        sprintf(text + used, "cpu%u running %u load %u.%u%u switches %lu migrations %lu\n",
+            i, core->nr_running, core->load_avg / SCHED_LOAD_SCALE,
+            core->load_avg % SCHED_LOAD_SCALE * 10 / SCHED_LOAD_SCALE,
+            core->load_avg % SCHED_LOAD_SCALE * 100 / SCHED_LOAD_SCALE % 10,
+            core->nr_switches, core->nr_migrations);
+        used += strlen(text + used);
+    }
+
+    long n = 0;
+    if ((size_t)offset < used) {
+        n = (used - offset < len) ? used - offset : len;
+        memcpy(buffer, text + offset, n);
+    }
+    kfree(text);
+    return n;
+}
+
 void sched_install(void) {
+    task_cache = kmem_cache_create("task", sizeof(struct task), NULL);
+    wait_queue_init(&vfork_wait);
+
+    struct vfs_node *schedstat = vfs_create_node("schedstat", VFS_CHARDEVICE);
+    schedstat->read = schedstat_read;
+    vfs_add_device(schedstat);
+
+    vma_install();
     printf("\033[92m * \033[97mInitialized scheduler\033[0m\n");
 }
\ No newline at end of file
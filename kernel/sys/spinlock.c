@@ -1,4 +1,14 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdatomic.h>
+#ifdef __x86_64__
+#include <kernel/arch/x86_64/tsc.h>
+#endif
+#include <kernel/vfs.h>
+#include <kernel/malloc.h>
+#include <kernel/printf.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
 
 void acquire(atomic_flag *lock) {
     while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
@@ -10,4 +20,185 @@ void acquire(atomic_flag *lock) {
 
 void release(atomic_flag *lock) {
     atomic_flag_clear_explicit(lock, memory_order_release);
-}
\ No newline at end of file
+}
+
+uint64_t irq_save(void) {
+    uint64_t flags = 0;
+#ifdef __x86_64__
+    __asm__ volatile ("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+#endif
+    return flags;
+}
+
+void irq_restore(uint64_t flags) {
+#ifdef __x86_64__
+    if (flags & (1 << 9)) __asm__ volatile ("sti" : : : "memory");
+#endif
+}
+
+uint64_t acquire_irqsave(atomic_flag *lock) {
+    uint64_t flags = irq_save();
+    acquire(lock);
+    return flags;
+}
+
+void release_irqrestore(atomic_flag *lock, uint64_t flags) {
+    release(lock);
+    irq_restore(flags);
+}
+
+static struct lock_stats *lock_stats_list = NULL;
+
+static uint64_t lock_timestamp(void) {
+#ifdef __x86_64__
+    return tsc_read();
+#else
+    return 0;
+#endif
+}
+
+/* runs with the lock held, which also protects the counters */
+static void lock_stats_acquired(struct lock_stats *stats, uint64_t spins) {
+    if (!stats->listed) {
+        stats->listed = true;
+        stats->next = __atomic_load_n(&lock_stats_list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&lock_stats_list, &stats->next, stats, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    stats->acquisitions++;
+    if (spins) {
+        stats->contended++;
+        stats->spins += spins;
+    }
+    stats->locked_at = lock_timestamp();
+}
+
+static void lock_stats_released(struct lock_stats *stats) {
+    uint64_t held = lock_timestamp() - stats->locked_at;
+    if (held > stats->max_hold)
+        stats->max_hold = held;
+}
+
+void spin_init(spinlock_t *lock) {
+    lock->next = 0;
+    lock->owner = 0;
+    lock->stats = NULL;
+}
+
+void spin_lock(spinlock_t *lock) {
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+#ifdef __x86_64__
+        __builtin_ia32_pause();
+#endif
+        spins++;
+    }
+
+    if (lock->stats)
+        lock_stats_acquired(lock->stats, spins);
+}
+
+bool spin_trylock(spinlock_t *lock) {
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    uint32_t ticket = owner;
+    if (!__atomic_compare_exchange_n(&lock->next, &ticket, owner + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    if (lock->stats)
+        lock_stats_acquired(lock->stats, 0);
+    return true;
+}
+
+void spin_unlock(spinlock_t *lock) {
+    if (lock->stats)
+        lock_stats_released(lock->stats);
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+void rwlock_init(rwlock_t *lock) {
+    lock->state = 0;
+}
+
+void read_lock(rwlock_t *lock) {
+    for (;;) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (!(state & (RWLOCK_WRITER | RWLOCK_WAITING))
+            && __atomic_compare_exchange_n(&lock->state, &state, state + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+#ifdef __x86_64__
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+void read_unlock(rwlock_t *lock) {
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(rwlock_t *lock) {
+    for (;;) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if ((state & ~RWLOCK_WAITING) == 0) {
+            /* taking it clears the waiting bit, other writers set it again */
+            if (__atomic_compare_exchange_n(&lock->state, &state, RWLOCK_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+        } else if (!(state & RWLOCK_WAITING)) {
+            __atomic_fetch_or(&lock->state, RWLOCK_WAITING, __ATOMIC_RELAXED);
+        }
+#ifdef __x86_64__
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+void write_unlock(rwlock_t *lock) {
+    __atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+long lockstat_read(struct vfs_node *node, void *buffer, long offset, size_t len) {
+    if (offset < 0)
+        return -EINVAL;
+
+    size_t count = 0;
+    struct lock_stats *stats;
+    for (stats = __atomic_load_n(&lock_stats_list, __ATOMIC_ACQUIRE); stats; stats = stats->next)
+        count++;
+
+    char *text = kmalloc(count * 160 + 1);
+    size_t used = 0;
+    text[0] = '\0';
+
+    /* read without the locks, the numbers may be slightly torn */
+    for (stats = __atomic_load_n(&lock_stats_list, __ATOMIC_ACQUIRE); stats && count--; stats = stats->next) {
+        sprintf(text + used, "%s acquisitions %lu contended %lu spins %lu max_hold %lu\n",
+            stats->name, stats->acquisitions, stats->contended, stats->spins, stats->max_hold);
+        used += strlen(text + used);
+    }
+
+    long n = 0;
+    if ((size_t)offset < used) {
+        n = (used - offset < len) ? used - offset : len;
+        memcpy(buffer, text + offset, n);
+    }
+    kfree(text);
+    return n;
+}
+
+void lockstat_initialize(void) {
+    struct vfs_node *lockstat = vfs_create_node("lockstat", VFS_CHARDEVICE);
+    lockstat->read = lockstat_read;
+    vfs_add_device(lockstat);
+}
@@ -33,6 +33,8 @@
 #define	X_OK	1
 #define	F_OK	0
 
+#define PRIO_PROCESS 0
+
 #define DT_REG  8
 #define DT_BLK  6
 #define DT_DIR  4
@@ -44,6 +46,9 @@
 
 #define TIOCGNAME   0x5483
 
+#define CLONE_VM    0x00000100
+#define CLONE_VFORK 0x00004000
+
 #define IOV_MAX 1024
 
 struct linux_dirent64 {
@@ -103,9 +108,15 @@ long sys_execve(const char *pathname, char *const *argv, char *const *envp) {
 }
 
 long sys_clone(struct registers *r) {
+    if ((r->rdi & (CLONE_VM | CLONE_VFORK)) == (CLONE_VM | CLONE_VFORK))
+        return vfork(r);
     return fork(r);
 }
 
+long sys_vfork(struct registers *r) {
+    return vfork(r);
+}
+
 long sys_wait4(int pid, int *wstatus) {
     if (!this->children) {
         return -ECHILD;
@@ -222,11 +233,12 @@ long sys_getdents64(int fd_num, struct linux_dirent64 *dirp, unsigned int count)
         return -EINVAL;
     }
 
-    struct vfs_node *child = dir->children;
+    int epoch = rcu_read_lock();
+    struct vfs_node *child = rcu_dereference(dir->children);
     int entries_to_skip = fd->offset;
     
     while (child && entries_to_skip > 0) {
-        child = child->next;
+        child = rcu_dereference(child->next);
         entries_to_skip--;
     }
     
@@ -265,9 +277,10 @@ long sys_getdents64(int fd_num, struct linux_dirent64 *dirp, unsigned int count)
         
         current_entry = (void*)current_entry + reclen;
         offset += reclen;
-        child = child->next;
+        child = rcu_dereference(child->next);
         fd->offset++;
     }
+    rcu_read_unlock(epoch);
     
     return offset;
 }
@@ -297,6 +310,24 @@ static unsigned int convert_mode(enum vfs_node_type type, uint16_t perms) {
     return mode;
 }
 
+static long fill_stat(struct vfs_node *node, struct stat *statbuf) {
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_mode = convert_mode(node->type, node->perms);
+    statbuf->st_nlink = 1;
+    statbuf->st_uid = 0;
+    statbuf->st_gid = 0;
+    statbuf->st_ino = node->inode;
+
+    if (node->type == VFS_FILE) {
+        statbuf->st_size = node->size;
+    } else if (node->type == VFS_DIRECTORY) {
+        statbuf->st_size = 4096;
+    } else {
+        statbuf->st_size = 0;
+    }
+    return 0;
+}
+
 long sys_stat(const char *pathname, struct stat *statbuf) {
     if (!pathname || !statbuf) {
         return -EFAULT;
@@ -369,34 +400,25 @@ long sys_newfstatat(int dirfd, const char *restrict pathname, struct stat *restr
         if (dir_fd->node->type != VFS_DIRECTORY)
             return -ENOTDIR;
 
-        struct vfs_node *child = dir_fd->node->children;
+        /* the child isn't opened, so stay in the read section while using it */
+        int epoch = rcu_read_lock();
+        struct vfs_node *child = rcu_dereference(dir_fd->node->children);
         while (child) {
             if (!strcmp(child->name, pathname)) {
-                node = child;
                 break;
             }
-            child = child->next;
+            child = rcu_dereference(child->next);
         }
+
+        long ret = child ? fill_stat(child, statbuf) : -ENOENT;
+        rcu_read_unlock(epoch);
+        return ret;
     }
 
     if (!node)
         return -ENOENT;
 
-    memset(statbuf, 0, sizeof(struct stat));
-    statbuf->st_mode = convert_mode(node->type, node->perms);
-    statbuf->st_nlink = 1;
-    statbuf->st_uid = 0;
-    statbuf->st_gid = 0;
-    statbuf->st_ino = node->inode;
-
-    if (node->type == VFS_FILE) {
-        statbuf->st_size = node->size;
-    } else if (node->type == VFS_DIRECTORY) {
-        statbuf->st_size = 4096;
-    } else {
-        statbuf->st_size = 0;
-    }
-    return 0;
+    return fill_stat(node, statbuf);
 }
 
 long sys_arch_prctl(int op, long extra) {
@@ -412,6 +434,15 @@ long sys_arch_prctl(int op, long extra) {
     return 0;
 }
 
+static uint64_t mmap_prot_flags(int prot) {
+    uint64_t vma_flags = PTE_USER;
+    if (prot != PROT_NONE) {
+        vma_flags |= PTE_PRESENT;
+        if (prot & PROT_WRITE) vma_flags |= PTE_WRITABLE;
+    }
+    return vma_flags;
+}
+
 long sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
     if (flags & MAP_ANONYMOUS) {
         if (offset != 0 || fd != -1) {
@@ -419,18 +450,13 @@ long sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offs
         }
     }
     
-    uint64_t vma_flags = PTE_USER;
-    if (prot != PROT_NONE) {
-        if (prot & PROT_READ) vma_flags |= PTE_PRESENT;
-        if (prot & PROT_WRITE) vma_flags |= PTE_WRITABLE;
-    }
+    uint64_t vma_flags = mmap_prot_flags(prot);
 
     size_t pages = ALIGN_UP(length, PAGE_SIZE) / PAGE_SIZE;
     void *ptr;
 
     if (flags & MAP_FIXED) {
         if (addr == NULL) {
-            sched_unlock();
             return -EINVAL;
         }
         ptr = vma_map(this->vma, pages, 0, (uint64_t)addr, vma_flags);
@@ -441,11 +467,7 @@ long sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offs
     if (!ptr)
         return -ENOMEM;
 
-    sched_lock();
-    if ((flags & MAP_ANONYMOUS) && (prot != PROT_NONE)) {
-        memset(ptr, 0, length);
-    }
-    sched_unlock();
+    /* pages are zero filled when they are first touched */
     return (long)ptr;
 }
 
@@ -457,18 +479,22 @@ long sys_munmap(void *addr, size_t length) {
 
     sched_lock();
     size_t pages = ALIGN_UP(length, PAGE_SIZE) / PAGE_SIZE;
-    uintptr_t start_addr = (uintptr_t)addr;
-    uintptr_t end_addr = start_addr + (pages * PAGE_SIZE);
-
-    uintptr_t current_addr = start_addr;
+    vma_unmap_range(this->vma, (uintptr_t)addr, pages);
+    sched_unlock();
+    return 0;
+}
 
-    while (current_addr < end_addr) {
-        vma_unmap_addr(this->vma, (void *)current_addr);
-        current_addr += PAGE_SIZE;
-    }
+long sys_mprotect(void *addr, size_t length, int prot) {
+    if ((uintptr_t)addr % PAGE_SIZE != 0)
+        return -EINVAL;
+    if (length == 0)
+        return 0;
 
+    sched_lock();
+    size_t pages = ALIGN_UP(length, PAGE_SIZE) / PAGE_SIZE;
+    bool mapped = vma_protect(this->vma, (uintptr_t)addr, pages, mmap_prot_flags(prot));
     sched_unlock();
-    return 0;
+    return mapped ? 0 : -ENOMEM;
 }
 
 long sys_rt_sigaction() {
@@ -508,6 +534,67 @@ long sys_getpgid(int pid) {
     return pid;
 }
 
+static struct task *find_task(int pid) {
+    return pid ? sched_find_task(pid) : this;
+}
+
+long sys_sched_yield(void) {
+    sched_yield();
+    return 0;
+}
+
+long sys_getpriority(int which, int who) {
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+    struct task *proc = find_task(who);
+    if (!proc)
+        return -ESRCH;
+    return 20 - proc->nice; /* kept positive, libc turns it back into a nice value */
+}
+
+long sys_setpriority(int which, int who, int prio) {
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+    struct task *proc = find_task(who);
+    if (!proc)
+        return -ESRCH;
+    return sched_set_nice(proc, prio);
+}
+
+long sys_sched_setscheduler(int pid, int policy, const int *param) {
+    if (!param)
+        return -EFAULT;
+    struct task *proc = find_task(pid);
+    if (!proc)
+        return -ESRCH;
+    return sched_set_policy(proc, policy, *param);
+}
+
+long sys_sched_getscheduler(int pid) {
+    struct task *proc = find_task(pid);
+    if (!proc)
+        return -ESRCH;
+    return proc->policy;
+}
+
+long sys_sched_getparam(int pid, int *param) {
+    if (!param)
+        return -EFAULT;
+    struct task *proc = find_task(pid);
+    if (!proc)
+        return -ESRCH;
+    *param = proc->rt_priority;
+    return 0;
+}
+
+long sys_sched_get_priority_max(int policy) {
+    return policy == SCHED_POLICY_FIFO || policy == SCHED_POLICY_RR ? 99 : 0;
+}
+
+long sys_sched_get_priority_min(int policy) {
+    return policy == SCHED_POLICY_FIFO || policy == SCHED_POLICY_RR ? 1 : 0;
+}
+
 long sys_clock_gettime(int clockid, struct timespec *tp) {
     (void)clockid;
     if (!tp)
@@ -517,6 +604,24 @@ long sys_clock_gettime(int clockid, struct timespec *tp) {
     return 0;
 }
 
+long sys_nanosleep(const struct timespec *req, struct timespec *rem) {
+    if (!req)
+        return -EFAULT;
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000)
+        return -EINVAL;
+
+    sched_sleep(req->tv_sec * 1000000 + (req->tv_nsec + 999) / 1000);
+
+    /* a signal wakes the task before its deadline */
+    size_t now = hpet_get_ticks();
+    size_t left = this->time.end > now ? hpet_ticks_to_us(this->time.end - now) : 0;
+    if (rem) {
+        rem->tv_sec = left / 1000000;
+        rem->tv_nsec = left % 1000000 * 1000;
+    }
+    return left ? -EINTR : 0;
+}
+
 char hostname[256] = "localhost";
 
 long sys_sethostname(const char *name, size_t len) {
@@ -734,6 +839,7 @@ static syscall_func syscalls[] = {
     [SYS_lstat]             = (syscall_func)(uintptr_t)sys_lstat,
     [SYS_lseek]             = (syscall_func)(uintptr_t)sys_lseek,
     [SYS_mmap]              = (syscall_func)(uintptr_t)sys_mmap,
+    [SYS_mprotect]          = (syscall_func)(uintptr_t)sys_mprotect,
     [SYS_munmap]            = (syscall_func)(uintptr_t)sys_munmap,
     [SYS_brk]               = (syscall_func)(uintptr_t)sys_brk,
     [SYS_rt_sigaction]      = (syscall_func)(uintptr_t)sys_rt_sigaction,
@@ -741,9 +847,12 @@ static syscall_func syscalls[] = {
     [SYS_ioctl]             = (syscall_func)(uintptr_t)sys_ioctl,
     [SYS_writev]            = (syscall_func)(uintptr_t)sys_writev,
     [SYS_access]            = (syscall_func)(uintptr_t)sys_access,
+    [SYS_sched_yield]       = (syscall_func)(uintptr_t)sys_sched_yield,
     [SYS_dup]               = (syscall_func)(uintptr_t)sys_dup,
+    [SYS_nanosleep]         = (syscall_func)(uintptr_t)sys_nanosleep,
     [SYS_getpid]            = (syscall_func)(uintptr_t)sys_getpid,
     [SYS_clone]             = (syscall_func)(uintptr_t)sys_clone,
+    [SYS_vfork]             = (syscall_func)(uintptr_t)sys_vfork,
     [SYS_execve]            = (syscall_func)(uintptr_t)sys_execve,
     [SYS_exit]              = (syscall_func)(uintptr_t)sys_exit,
     [SYS_wait4]             = (syscall_func)(uintptr_t)sys_wait4,
@@ -756,6 +865,13 @@ static syscall_func syscalls[] = {
     [SYS_getegid]           = (syscall_func)(uintptr_t)sys_getegid,
     [SYS_getppid]           = (syscall_func)(uintptr_t)sys_getppid,
     [SYS_getpgid]           = (syscall_func)(uintptr_t)sys_getpgid,
+    [SYS_getpriority]       = (syscall_func)(uintptr_t)sys_getpriority,
+    [SYS_setpriority]       = (syscall_func)(uintptr_t)sys_setpriority,
+    [SYS_sched_getparam]    = (syscall_func)(uintptr_t)sys_sched_getparam,
+    [SYS_sched_setscheduler] = (syscall_func)(uintptr_t)sys_sched_setscheduler,
+    [SYS_sched_getscheduler] = (syscall_func)(uintptr_t)sys_sched_getscheduler,
+    [SYS_sched_get_priority_max] = (syscall_func)(uintptr_t)sys_sched_get_priority_max,
+    [SYS_sched_get_priority_min] = (syscall_func)(uintptr_t)sys_sched_get_priority_min,
     [SYS_arch_prctl]        = (syscall_func)(uintptr_t)sys_arch_prctl,
     [SYS_sethostname]       = (syscall_func)(uintptr_t)sys_sethostname,
     [SYS_gettid]            = (syscall_func)(uintptr_t)sys_getpid,
@@ -771,10 +887,9 @@ void syscall_handler(struct registers *r) {
     if (r->rax > sizeof syscalls / sizeof(void *) || !syscalls[r->rax]) {
         dprintf("%s:%d: unknown syscall %lu\n", __FILE__, __LINE__, r->rax);
         r->rax = -ENOSYS;
-        sched_unlock();
         return;
     }
 
     syscall_func handler = syscalls[r->rax];
-    r->rax = handler(r->rax == SYS_clone ? (long)r : r->rdi, r->rsi, r->rdx, r->r10, r->r8, r->r9);
+    r->rax = handler(r->rax == SYS_clone || r->rax == SYS_vfork ? (long)r : r->rdi, r->rsi, r->rdx, r->r10, r->r8, r->r9);
 }
\ No newline at end of file
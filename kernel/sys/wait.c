@@ -0,0 +1,70 @@
+#include <stddef.h>
+#include <kernel/arch/x86_64/smp.h>
+#include <kernel/wait.h>
+#include <kernel/sched.h>
+#include <kernel/spinlock.h>
+
+void wait_queue_init(struct wait_queue *wq) {
+    wq->head = NULL;
+    wq->tail = NULL;
+    release(&wq->lock);
+}
+
+static void wait_unlink(struct wait_queue *wq, struct wait_queue_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        wq->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        wq->tail = entry->prev;
+    entry->queued = false;
+}
+
+void wait_prepare(struct wait_queue *wq, struct wait_queue_entry *entry) {
+    uint64_t flags = acquire_irqsave(&wq->lock);
+    if (!entry->queued) {
+        entry->next = NULL;
+        entry->prev = wq->tail;
+        if (wq->tail)
+            wq->tail->next = entry;
+        else
+            wq->head = entry;
+        wq->tail = entry;
+        entry->queued = true;
+    }
+    entry->proc->state = TASK_PAUSED;
+    release_irqrestore(&wq->lock, flags);
+}
+
+void wait_finish(struct wait_queue *wq, struct wait_queue_entry *entry) {
+    uint64_t flags = acquire_irqsave(&wq->lock);
+    if (entry->queued)
+        wait_unlink(wq, entry);
+    entry->proc->state = TASK_RUNNING;
+    release_irqrestore(&wq->lock, flags);
+}
+
+/* wake every waiter, they recheck their condition themselves */
+void wake_up(struct wait_queue *wq) {
+    uint64_t flags = acquire_irqsave(&wq->lock);
+    while (wq->head) {
+        struct wait_queue_entry *entry = wq->head;
+        struct task *proc = entry->proc;
+        wait_unlink(wq, entry);
+        sched_unblock(proc);
+    }
+    release_irqrestore(&wq->lock, flags);
+}
+
+void wake_up_one(struct wait_queue *wq) {
+    uint64_t flags = acquire_irqsave(&wq->lock);
+    if (wq->head) {
+        struct wait_queue_entry *entry = wq->head;
+        struct task *proc = entry->proc;
+        wait_unlink(wq, entry);
+        sched_unblock(proc);
+    }
+    release_irqrestore(&wq->lock, flags);
+}
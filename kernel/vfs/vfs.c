@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/kmem.h>
 #include <kernel/malloc.h>
 #include <kernel/string.h>
 #include <kernel/printf.h>
@@ -13,6 +14,7 @@
 /* TODO: should node->open be handled by the VFS or the FD table? */
 
 extern void zero_initialize(void);
+extern void lockstat_initialize(void);
 extern void ps2_initialize(void);
 extern void serial_initialize(void);
 extern void console_initialize(void);
@@ -21,6 +23,11 @@ extern void tmpfs_initialize(void);
 struct vfs_node *vfs_root = NULL;
 struct vfs_node *vfs_dev = NULL;
 
+static struct kmem_cache *vfs_node_cache = NULL;
+
+/* serializes changes to the tree, lookups don't take it */
+static spinlock_t vfs_tree_lock = SPINLOCK_INIT;
+
 const char *vfs_types[] = {
     "VFS_NONE",
     "VFS_FILE",
@@ -30,8 +37,14 @@ const char *vfs_types[] = {
     "VFS_SYMLINK"
 };
 
+static void vfs_node_ctor(void *obj) {
+    struct vfs_node *node = (struct vfs_node *)obj;
+    rwsem_init(&node->lock);
+    release(&node->cache_lock);
+}
+
 struct vfs_node *vfs_create_node(const char *name, enum vfs_node_type type) {
-    struct vfs_node *node = (struct vfs_node *)kmalloc(sizeof(struct vfs_node));
+    struct vfs_node *node = (struct vfs_node *)kmem_cache_alloc(vfs_node_cache);
     strcpy(node->name, name);
     node->open = false;
     node->type = type;
@@ -44,7 +57,9 @@ struct vfs_node *vfs_create_node(const char *name, enum vfs_node_type type) {
     node->read = NULL;
     node->write = NULL;
     node->symlink_target = NULL;
-    release(&node->lock);
+    node->cache = NULL;
+    node->cache_pages = 0;
+    node->mappings = 0;
     return node;
 }
 
@@ -52,15 +67,29 @@ void vfs_add_node(struct vfs_node *root, struct vfs_node *node) {
     if (!root) root = vfs_root;
 
     node->parent = root;
+    node->next = NULL;
+
+    /* the node must be complete before lookups can reach it */
+    uint64_t flags = spin_lock_irqsave(&vfs_tree_lock);
     if (root->children == NULL) {
-        root->children = node;
+        rcu_assign(root->children, node);
     } else {
         struct vfs_node *child = root->children;
         while (child->next != NULL) {
             child = child->next;
         }
-        child->next = node;
+        rcu_assign(child->next, node);
     }
+    spin_unlock_irqrestore(&vfs_tree_lock, flags);
+}
+
+static void vfs_free_node(struct rcu_head *head) {
+    struct vfs_node *node = (struct vfs_node *)((uintptr_t)head - offsetof(struct vfs_node, rcu));
+    if (node->type == VFS_SYMLINK && node->symlink_target) {
+        kfree(node->symlink_target);
+        node->symlink_target = NULL;
+    }
+    kmem_cache_free(vfs_node_cache, node);
 }
 
 int vfs_remove_node(struct vfs_node *node) {
@@ -78,6 +107,11 @@ int vfs_remove_node(struct vfs_node *node) {
         dprintf("Node is open!\n");
         return -EBUSY;
     }
+
+    if (__atomic_load_n(&node->mappings, __ATOMIC_ACQUIRE)) {
+        dprintf("Node is mapped!\n");
+        return -ETXTBSY;
+    }
     
     if (node->type == VFS_DIRECTORY && node->children != NULL) {
         dprintf("Node has children!\n");
@@ -103,32 +137,36 @@ int vfs_remove_node(struct vfs_node *node) {
         }   
     }
     
-    if (node->parent) {
-        if (node->parent->children == node) {
-            node->parent->children = node->next;
-        } else {
-            struct vfs_node *prev = node->parent->children;
-            while (prev && prev->next != node) {
-                prev = prev->next;
-            }
-            if (prev) {
-                prev->next = node->next;
-            }
-        }
+    /* checked again under the lock, a child may have been added meanwhile */
+    uint64_t flags = spin_lock_irqsave(&vfs_tree_lock);
+    if (node->type == VFS_DIRECTORY && node->children != NULL) {
+        spin_unlock_irqrestore(&vfs_tree_lock, flags);
+        dprintf("Node has children!\n");
+        return -ENOTEMPTY;
     }
-    
-    if (node->type == VFS_SYMLINK && node->symlink_target) {
-        kfree(node->symlink_target);
-        node->symlink_target = NULL;
+
+    if (node->parent->children == node) {
+        rcu_assign(node->parent->children, node->next);
+    } else {
+        struct vfs_node *prev = node->parent->children;
+        while (prev && prev->next != node) {
+            prev = prev->next;
+        }
+        if (prev) {
+            rcu_assign(prev->next, node->next);
+        }
     }
-    
-    node->parent = NULL;
-    node->children = NULL;
-    node->next = NULL;
+    spin_unlock_irqrestore(&vfs_tree_lock, flags);
+
+    /*
+     * lookups that already reached the node may still read its name,
+     * next and parent, so those stay intact until the node is freed
+     */
     node->read = NULL;
     node->write = NULL;
-    
-    kfree(node);
+    vfs_cache_drop(node);
+
+    call_rcu(&node->rcu, vfs_free_node);
     return 0;
 }
 
@@ -198,6 +236,7 @@ struct vfs_node* vfs_open(struct vfs_node *current, const char *path) {
 
     bool is_tmp = (token && !strcmp(token, "tmp") && current == vfs_root);
 
+    int epoch = rcu_read_lock();
     struct vfs_node *node = current;
     while (token != NULL) {
         if (!strcmp(token, ".")) {
@@ -207,7 +246,7 @@ struct vfs_node* vfs_open(struct vfs_node *current, const char *path) {
                 node = node->parent;
             }
         } else {
-            struct vfs_node *child = node->children;
+            struct vfs_node *child = rcu_dereference(node->children);
             bool found = false;
 
             while (child != NULL) {
@@ -217,6 +256,7 @@ struct vfs_node* vfs_open(struct vfs_node *current, const char *path) {
                     if (node->type == VFS_SYMLINK) {
                         node = vfs_resolve_symlink(node, MAX_NESTED_SYMLINKS);
                         if (!node) {
+                            rcu_read_unlock(epoch);
                             kfree(copy);
                             return NULL;
                         }
@@ -225,10 +265,11 @@ struct vfs_node* vfs_open(struct vfs_node *current, const char *path) {
                     found = true;
                     break;
                 }
-                child = child->next;
+                child = rcu_dereference(child->next);
             }
 
             if (!found) {
+                rcu_read_unlock(epoch);
                 kfree(copy);
 
                 if (is_tmp) {
@@ -242,6 +283,7 @@ struct vfs_node* vfs_open(struct vfs_node *current, const char *path) {
     }
 
     node->open = true;
+    rcu_read_unlock(epoch);
     kfree(copy);
     return node;
 }
@@ -267,37 +309,198 @@ void vfs_resolve_path(char *s, struct vfs_node *node) {
     strcpy(s, path);
 }
 
+/*
+ * Regular files copy user buffers through the kernel outside node->lock,
+ * a fault on the buffer may read a file mapping and take the lock again.
+ */
+#define VFS_BOUNCE_SIZE (16 * PAGE_SIZE)
+#define VFS_USER_TOP 0x800000000000
+
+static bool vfs_bounce(void *buffer, size_t len) {
+    return len && (uintptr_t)buffer < VFS_USER_TOP;
+}
+
+static long vfs_file_read(struct vfs_node *node, void *buffer, long offset, size_t len) {
+    rwsem_read_lock(&node->lock);
+    long ret = node->read(node, buffer, offset, len);
+    rwsem_read_unlock(&node->lock);
+    return ret;
+}
+
+static long vfs_file_write(struct vfs_node *node, void *buffer, long offset, size_t len) {
+    rwsem_write_lock(&node->lock);
+    long ret = node->write(node, buffer, offset, len);
+    rwsem_write_unlock(&node->lock);
+    return ret;
+}
+
 long vfs_read(struct vfs_node *node, void *buffer, long offset, size_t len) {
     if (!node /*|| !node->open*/) return -1;
     if (node->read) {
-        //acquire(&node->lock);
-        long ret = node->read(node, buffer, offset, len);
-        //release(&node->lock);
-        return ret;
+        /* devices may block in read, only regular files take the lock */
+        if (node->type != VFS_FILE)
+            return node->read(node, buffer, offset, len);
+        if (!vfs_bounce(buffer, len))
+            return vfs_file_read(node, buffer, offset, len);
+
+        char *bounce = kmalloc(len < VFS_BOUNCE_SIZE ? len : VFS_BOUNCE_SIZE);
+        if (!bounce)
+            return -ENOMEM;
+
+        long done = 0;
+        while ((size_t)done < len) {
+            size_t n = len - done < VFS_BOUNCE_SIZE ? len - done : VFS_BOUNCE_SIZE;
+            long ret = vfs_file_read(node, bounce, offset + done, n);
+            if (ret < 0) {
+                if (!done)
+                    done = ret;
+                break;
+            }
+            memcpy((char *)buffer + done, bounce, ret);
+            done += ret;
+            if ((size_t)ret < n)
+                break;
+        }
+        kfree(bounce);
+        return done;
     }
     return -1;
 }
 
 long vfs_write(struct vfs_node *node, void *buffer, long offset, size_t len) {
     if (!node /*|| !node->open*/) return -1;
+    /* pages not faulted in yet would see the new contents */
+    if (__atomic_load_n(&node->mappings, __ATOMIC_ACQUIRE)) return -ETXTBSY;
     if (node->write) {
-        //acquire(&node->lock);
-        long ret = node->write(node, buffer, offset, len);
-        //release(&node->lock);
-        return ret;
+        vfs_cache_drop(node);
+        if (node->type != VFS_FILE)
+            return node->write(node, buffer, offset, len);
+        if (!vfs_bounce(buffer, len))
+            return vfs_file_write(node, buffer, offset, len);
+
+        char *bounce = kmalloc(len < VFS_BOUNCE_SIZE ? len : VFS_BOUNCE_SIZE);
+        if (!bounce)
+            return -ENOMEM;
+
+        long done = 0;
+        while ((size_t)done < len) {
+            size_t n = len - done < VFS_BOUNCE_SIZE ? len - done : VFS_BOUNCE_SIZE;
+            memcpy(bounce, (char *)buffer + done, n);
+            long ret = vfs_file_write(node, bounce, offset + done, n);
+            if (ret < 0) {
+                if (!done)
+                    done = ret;
+                break;
+            }
+            done += ret;
+            if ((size_t)ret < n)
+                break;
+        }
+        kfree(bounce);
+        return done;
     }
     return -1;
 }
 
+/* make room for index in the cache array, called with cache_lock held */
+static void vfs_cache_grow(struct vfs_node *node, uint64_t index) {
+    if (node->cache && index < node->cache_pages)
+        return;
+
+    size_t pages = DIV_CEILING(node->size, PAGE_SIZE);
+    if (pages <= index)
+        pages = index + 1;
+
+    uintptr_t *cache = (uintptr_t *)kmalloc(pages * sizeof(uintptr_t));
+    memset(cache, 0, pages * sizeof(uintptr_t));
+    if (node->cache) {
+        memcpy(cache, node->cache, node->cache_pages * sizeof(uintptr_t));
+        kfree(node->cache);
+    }
+    node->cache = cache;
+    node->cache_pages = pages;
+}
+
+/*
+ * Returns the physical page holding the file contents at a page aligned
+ * offset, reading it in on first use. The cache keeps the page and the
+ * caller gets its own reference, dropped with mmu_free().
+ *
+ * The read may sleep, so it runs without the lock. Two tasks faulting
+ * on the same page both read it and the loser frees its copy.
+ */
+uintptr_t vfs_cache_page(struct vfs_node *node, uint64_t offset) {
+    if (offset >= node->size)
+        return 0;
+
+    uint64_t index = offset / PAGE_SIZE;
+    uint64_t flags = acquire_irqsave(&node->cache_lock);
+    if (node->cache && index < node->cache_pages && node->cache[index]) {
+        uintptr_t phys = node->cache[index];
+        mmu_page_ref((void *)phys);
+        release_irqrestore(&node->cache_lock, flags);
+        return phys;
+    }
+    release_irqrestore(&node->cache_lock, flags);
+
+    void *page = mmu_alloc(1);
+    memset(VIRTUAL_IDENT(page), 0, PAGE_SIZE);
+    vfs_read(node, VIRTUAL_IDENT(page), offset, PAGE_SIZE);
+
+    flags = acquire_irqsave(&node->cache_lock);
+    vfs_cache_grow(node, index);
+    if (node->cache[index])
+        mmu_free(page, 1);
+    else
+        node->cache[index] = (uintptr_t)page;
+
+    uintptr_t phys = node->cache[index];
+    mmu_page_ref((void *)phys);
+    release_irqrestore(&node->cache_lock, flags);
+    return phys;
+}
+
+/* forget the cached pages, mappings that still use them keep their reference */
+void vfs_cache_drop(struct vfs_node *node) {
+    uint64_t flags = acquire_irqsave(&node->cache_lock);
+    if (!node->cache) {
+        release_irqrestore(&node->cache_lock, flags);
+        return;
+    }
+
+    for (size_t i = 0; i < node->cache_pages; i++) {
+        if (node->cache[i])
+            mmu_free((void *)node->cache[i], 1);
+    }
+    kfree(node->cache);
+    node->cache = NULL;
+    node->cache_pages = 0;
+    release_irqrestore(&node->cache_lock, flags);
+}
+
+/*
+ * File backed vma blocks read the node on demand, so it must outlive
+ * them. Mapped nodes can't be removed or written to.
+ */
+void vfs_map_get(struct vfs_node *node) {
+    __atomic_fetch_add(&node->mappings, 1, __ATOMIC_ACQ_REL);
+}
+
+void vfs_map_put(struct vfs_node *node) {
+    __atomic_fetch_sub(&node->mappings, 1, __ATOMIC_ACQ_REL);
+}
+
 bool vfs_poll(struct vfs_node *node) {
     // TODO: use mutexes
-    acquire(&node->lock);
-    release(&node->lock);
+    rwsem_read_lock(&node->lock);
+    rwsem_read_unlock(&node->lock);
     return true;
 }
 
 void vfs_install(void) {
-    vfs_root = (struct vfs_node *)kmalloc(sizeof(struct vfs_node));
+    vfs_node_cache = kmem_cache_create("vfs_node", sizeof(struct vfs_node), vfs_node_ctor);
+
+    vfs_root = (struct vfs_node *)kmem_cache_alloc(vfs_node_cache);
     vfs_root->type = VFS_DIRECTORY;
     vfs_root->size = 0;
     vfs_root->perms = 0;
@@ -308,12 +511,15 @@ void vfs_install(void) {
     vfs_root->read = NULL;
     vfs_root->write = NULL;
     vfs_root->symlink_target = NULL;
-    release(&vfs_root->lock);
+    vfs_root->cache = NULL;
+    vfs_root->cache_pages = 0;
+    vfs_root->mappings = 0;
 
     vfs_dev = vfs_create_node("dev", VFS_DIRECTORY);
     vfs_add_node(vfs_root, vfs_dev);
 
     zero_initialize();
+    lockstat_initialize();
     ps2_initialize();
     serial_initialize();
     console_initialize();